@@ -18,30 +18,36 @@
 
 #include <QApplication>
 #include <QFileDialog>
+#include <QFileInfo>
 
+#include "xwahacker-fleet.h"
 #include "xwahacker-qt.h"
 
 int main(int argc, char *argv[])
 {
     QApplication app(argc, argv);
 
-    char *filename = NULL;
-    if (argc > 1) filename = strdup(argv[1]);
+    QString filename;
+    if (argc > 1) filename = QString::fromLocal8Bit(argv[1]);
     else
     {
-        QString name = QFileDialog::getOpenFileName(0, QObject::tr("Select xwingalliance.exe to edit"), QString(), "xwingalliance.exe;;*.exe;;*.*");
-        if (name.isNull())
+        filename = QFileDialog::getOpenFileName(0, QObject::tr("Select xwingalliance.exe to edit"), QString(), "xwingalliance.exe;;*.exe;;*.*");
+        if (filename.isNull())
             return 1;
-        QByteArray tmp = name.toLocal8Bit();
-        filename = strdup(tmp.data());
+    }
+
+    // a directory opens the view for all installs below it
+    if (QFileInfo(filename).isDir())
+    {
+        XWAFleet fleet;
+        fleet.show();
+        fleet.openDirectory(filename);
+        return app.exec();
     }
 
     XWAHacker window;
-    if (!window.openBinary(filename))
-        return 1;
-    free(filename);
-    filename = NULL;
     window.show();
+    window.openBinary(filename);
 
     return app.exec();
 }
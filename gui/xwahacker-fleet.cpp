@@ -0,0 +1,333 @@
+/*
+ * Qt fleet view for XWAHacker, edits many installs at once
+ * Copyright (C) 2026 Reimar Döffinger
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <QDir>
+#include <QDirIterator>
+#include <QGridLayout>
+#include <QHeaderView>
+#include <QLabel>
+#include <QStatusBar>
+#include <QVBoxLayout>
+#include <QtConcurrentMap>
+
+#include "xwahacker-fleet.h"
+
+enum {
+    COL_FILE = 0,
+    COL_BINARY,
+    COL_OPTS,
+    COL_RES = COL_OPTS + NUM_OPTS,
+    COL_SHOWFPS = COL_RES + 4,
+    COL_STATUS,
+    NUM_COLS
+};
+
+static const char *opt_short_names[NUM_OPTS] = {
+    [OPT_FIXED_CLEAR] = "Clear fix",
+    [OPT_FORCE_800] = "Force 800x600",
+    [OPT_USE_32BIT] = "32 bit",
+    [OPT_NOCD] = "No CD",
+    [OPT_NOSTARS] = "No stars",
+    [OPT_MSGLOOP] = "Hangar fix",
+};
+
+static const char *res_names[4] = {
+    "640x480", "800x600", "1152x864", "1600x1200",
+};
+
+/// bulk actions are stored in the combo box as option * 2 + enable,
+/// or ACTION_SHOWFPS + mode
+enum {
+    ACTION_SHOWFPS = 2 * NUM_OPTS,
+};
+
+static bool editable(const XWAState &state)
+{
+    return state.error.isEmpty() && state.res[0].w > 0;
+}
+
+static QString saveJob(const FleetJob &job)
+{
+    return saveState(job.filename, job.old, job.state);
+}
+
+XWAFleet::XWAFleet()
+{
+    table = new QTableWidget(0, NUM_COLS);
+    QStringList headers;
+    headers << tr("File") << tr("Binary");
+    for (int i = 0; i < NUM_OPTS; ++i)
+        headers << tr(opt_short_names[i]);
+    for (int i = 0; i < 4; ++i)
+        headers << res_names[i];
+    headers << tr("Show FPS") << tr("Status");
+    table->setHorizontalHeaderLabels(headers);
+    for (int i = 0; i < NUM_OPTS; ++i)
+        table->horizontalHeaderItem(COL_OPTS + i)->setToolTip(tr(opt_names[i]));
+    table->setEditTriggers(QAbstractItemView::NoEditTriggers);
+    table->setSelectionBehavior(QAbstractItemView::SelectRows);
+    table->setSelectionMode(QAbstractItemView::ExtendedSelection);
+    table->setSortingEnabled(true);
+    table->verticalHeader()->hide();
+
+    action = new QComboBox();
+    for (int i = 0; i < NUM_OPTS; ++i)
+    {
+        action->addItem(tr("Enable: %1").arg(tr(opt_names[i])), 2 * i + 1);
+        action->addItem(tr("Disable: %1").arg(tr(opt_names[i])), 2 * i);
+    }
+    for (int i = 0; i < NUM_SHOWFPS; ++i)
+        action->addItem(tr("Show FPS: %1").arg(tr(showfps_names[i])), ACTION_SHOWFPS + i);
+    action_button = new QPushButton(tr("Apply to selected"));
+
+    res_slot = new QComboBox();
+    for (int i = 0; i < 4; ++i)
+        res_slot->addItem(res_names[i]);
+    res_w = new QSpinBox();
+    res_w->setRange(640, 8192);
+    res_w->setValue(1920);
+    res_h = new QSpinBox();
+    res_h->setRange(480, 8192);
+    res_h->setValue(1080);
+    res_button = new QPushButton(tr("Set resolution of selected"));
+    rescan_button = new QPushButton(tr("Rescan"));
+
+    QGridLayout *edit_layout = new QGridLayout();
+    edit_layout->addWidget(action, 0, 0, 1, 4);
+    edit_layout->addWidget(action_button, 0, 4);
+    edit_layout->addWidget(res_slot, 1, 0);
+    edit_layout->addWidget(new QLabel(tr("becomes")), 1, 1);
+    edit_layout->addWidget(res_w, 1, 2);
+    edit_layout->addWidget(res_h, 1, 3);
+    edit_layout->addWidget(res_button, 1, 4);
+    edit_layout->addWidget(rescan_button, 2, 4);
+    edit_layout->setColumnStretch(0, 1);
+
+    QVBoxLayout *main_layout = new QVBoxLayout();
+    main_layout->addWidget(table);
+    main_layout->addLayout(edit_layout);
+
+    QWidget *central_widget = new QWidget();
+    central_widget->setLayout(main_layout);
+    setCentralWidget(central_widget);
+    resize(1200, 600);
+
+    progress = new QProgressBar();
+    progress->hide();
+    statusBar()->addPermanentWidget(progress);
+
+    connect(action_button, SIGNAL(clicked()), this, SLOT(applyAction()));
+    connect(res_button, SIGNAL(clicked()), this, SLOT(applyResolution()));
+    connect(rescan_button, SIGNAL(clicked()), this, SLOT(rescan()));
+    connect(&scan_watcher, SIGNAL(finished()), this, SLOT(scanFinished()));
+    connect(&scan_watcher, SIGNAL(progressRangeChanged(int,int)), progress, SLOT(setRange(int,int)));
+    connect(&scan_watcher, SIGNAL(progressValueChanged(int)), progress, SLOT(setValue(int)));
+    connect(&save_watcher, SIGNAL(finished()), this, SLOT(saveFinished()));
+    connect(&save_watcher, SIGNAL(progressRangeChanged(int,int)), progress, SLOT(setRange(int,int)));
+    connect(&save_watcher, SIGNAL(progressValueChanged(int)), progress, SLOT(setValue(int)));
+}
+
+void XWAFleet::setBusy(const QString &msg)
+{
+    bool busy = !msg.isEmpty();
+    progress->setVisible(busy);
+    action_button->setEnabled(!busy);
+    res_button->setEnabled(!busy);
+    rescan_button->setEnabled(!busy);
+    if (!busy)
+        statusBar()->showMessage(tr("%1 files in %2").arg(entries.size()).arg(dir));
+    else
+        statusBar()->showMessage(msg);
+}
+
+/**
+ * Detect all .exe files below dir, all files are loaded in parallel
+ * on the global thread pool.
+ */
+void XWAFleet::openDirectory(const QString &name)
+{
+    dir = name;
+    setWindowTitle(tr("XWAHacker - %1").arg(QDir::toNativeSeparators(dir)));
+    rescan();
+}
+
+void XWAFleet::rescan()
+{
+    files.clear();
+    QDirIterator it(dir, QStringList() << "*.exe", QDir::Files, QDirIterator::Subdirectories);
+    while (it.hasNext())
+        files << it.next();
+    setBusy(tr("Detecting %1 files...").arg(files.size()));
+    scan_watcher.setFuture(QtConcurrent::mapped(files, scanState));
+}
+
+void XWAFleet::scanFinished()
+{
+    filenames.clear();
+    entries.clear();
+    status.clear();
+    for (int i = 0; i < files.size(); ++i)
+    {
+        XWAState state = scan_watcher.resultAt(i);
+        // files that could not be read might be supported, show them with the error
+        if (state.binary.isEmpty() && state.readable)
+            continue;
+        filenames.append(files[i]);
+        status.append(state.error.isEmpty() ? state.warning : state.error);
+        entries.append(state);
+    }
+    fillTable();
+    setBusy(QString());
+}
+
+void XWAFleet::fillTable()
+{
+    table->setSortingEnabled(false);
+    table->clearContents();
+    table->setRowCount(entries.size());
+    for (int i = 0; i < entries.size(); ++i)
+        fillRow(i, i);
+    table->setSortingEnabled(true);
+    table->resizeColumnsToContents();
+}
+
+static void setCell(QTableWidget *table, int row, int col, const QString &text)
+{
+    QTableWidgetItem *item = table->item(row, col);
+    if (!item)
+    {
+        item = new QTableWidgetItem();
+        table->setItem(row, col, item);
+    }
+    item->setText(text);
+}
+
+void XWAFleet::fillRow(int row, int entry)
+{
+    const XWAState &state = entries[entry];
+    bool opts = editable(state) && state.opts_supported;
+    setCell(table, row, COL_FILE, QDir::toNativeSeparators(QDir(dir).relativeFilePath(filenames[entry])));
+    table->item(row, COL_FILE)->setData(Qt::UserRole, entry);
+    setCell(table, row, COL_BINARY, state.binary);
+    for (int i = 0; i < NUM_OPTS; ++i)
+        setCell(table, row, COL_OPTS + i, !opts ? QString() : state.opts[i] ? tr("on") : tr("off"));
+    for (int i = 0; i < 4; ++i)
+        setCell(table, row, COL_RES + i, !editable(state) ? QString() :
+                QString("%1x%2").arg(state.res[i].w).arg(state.res[i].h));
+    setCell(table, row, COL_SHOWFPS, !opts || state.showfps == SHOWFPS_INVALID ? QString() :
+            tr(showfps_names[state.showfps]));
+    setCell(table, row, COL_STATUS, status[entry]);
+}
+
+/**
+ * \return entry indices of the selected rows, independent of sorting
+ */
+QVector<int> XWAFleet::selectedEntries() const
+{
+    QVector<int> res;
+    QModelIndexList rows = table->selectionModel()->selectedRows();
+    for (int i = 0; i < rows.size(); ++i)
+        res.append(table->item(rows[i].row(), COL_FILE)->data(Qt::UserRole).toInt());
+    return res;
+}
+
+void XWAFleet::applyAction()
+{
+    int a = action->itemData(action->currentIndex()).toInt();
+    QVector<int> sel = selectedEntries();
+    QVector<FleetJob> todo;
+    for (int i = 0; i < sel.size(); ++i)
+    {
+        FleetJob job;
+        job.entry = sel[i];
+        job.filename = filenames[sel[i]];
+        job.old = entries[sel[i]];
+        job.state = job.old;
+        if (!editable(job.old) || !job.old.opts_supported)
+            continue;
+        if (a >= ACTION_SHOWFPS)
+            job.state.showfps = static_cast<ShowFPS>(a - ACTION_SHOWFPS);
+        else
+            job.state.opts[a / 2] = a & 1;
+        todo.append(job);
+    }
+    startSave(todo);
+}
+
+void XWAFleet::applyResolution()
+{
+    int slot = res_slot->currentIndex();
+    QVector<int> sel = selectedEntries();
+    QVector<FleetJob> todo;
+    for (int i = 0; i < sel.size(); ++i)
+    {
+        FleetJob job;
+        job.entry = sel[i];
+        job.filename = filenames[sel[i]];
+        job.old = entries[sel[i]];
+        job.state = job.old;
+        if (!editable(job.old))
+            continue;
+        job.state.res[slot] = defaultResolution(res_w->value(), res_h->value());
+        todo.append(job);
+    }
+    startSave(todo);
+}
+
+/**
+ * Write the changes of all jobs in parallel on the global thread pool.
+ */
+void XWAFleet::startSave(const QVector<FleetJob> &todo)
+{
+    if (todo.isEmpty())
+    {
+        statusBar()->showMessage(tr("No editable X-Wing Alliance binary selected"));
+        return;
+    }
+    jobs = todo;
+    setBusy(tr("Saving %1 files...").arg(jobs.size()));
+    save_watcher.setFuture(QtConcurrent::mapped(jobs, saveJob));
+}
+
+void XWAFleet::saveFinished()
+{
+    int failed = 0;
+    for (int i = 0; i < jobs.size(); ++i)
+    {
+        const FleetJob &job = jobs[i];
+        QString error = save_watcher.resultAt(i);
+        if (error.isEmpty())
+        {
+            entries[job.entry] = job.state;
+            status[job.entry] = tr("Saved");
+        }
+        else
+        {
+            status[job.entry] = error;
+            failed++;
+        }
+    }
+    jobs.clear();
+    table->setSortingEnabled(false);
+    for (int row = 0; row < table->rowCount(); ++row)
+        fillRow(row, table->item(row, COL_FILE)->data(Qt::UserRole).toInt());
+    table->setSortingEnabled(true);
+    setBusy(QString());
+    if (failed)
+        statusBar()->showMessage(tr("Saving failed for %1 files").arg(failed));
+}
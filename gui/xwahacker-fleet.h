@@ -0,0 +1,86 @@
+/*
+ * Qt fleet view for XWAHacker, edits many installs at once
+ * Copyright (C) 2026 Reimar Döffinger
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef XWAHACKER_FLEET_H
+#define XWAHACKER_FLEET_H
+
+#include <QComboBox>
+#include <QFutureWatcher>
+#include <QMainWindow>
+#include <QProgressBar>
+#include <QPushButton>
+#include <QSpinBox>
+#include <QStringList>
+#include <QTableWidget>
+#include <QVector>
+
+#include "xwahacker-qt.h"
+
+/**
+ * One change for one file, handed to the worker pool.
+ */
+struct FleetJob
+{
+    int entry; ///< index into XWAFleet::entries
+    QString filename;
+    XWAState old;
+    XWAState state;
+};
+
+class XWAFleet : public QMainWindow
+{
+    Q_OBJECT
+
+public:
+    XWAFleet();
+    virtual ~XWAFleet() {}
+    void openDirectory(const QString &dir);
+
+private slots:
+    void rescan();
+    void applyAction();
+    void applyResolution();
+    void scanFinished();
+    void saveFinished();
+
+private:
+    void setBusy(const QString &msg);
+    void fillTable();
+    void fillRow(int row, int entry);
+    QVector<int> selectedEntries() const;
+    void startSave(const QVector<FleetJob> &jobs);
+    QTableWidget *table;
+    QComboBox *action;
+    QPushButton *action_button;
+    QComboBox *res_slot;
+    QSpinBox *res_w;
+    QSpinBox *res_h;
+    QPushButton *res_button;
+    QPushButton *rescan_button;
+    QProgressBar *progress;
+    QString dir;
+    QStringList files;          ///< all candidates of the last scan
+    QVector<QString> filenames; ///< detected files, same order as entries
+    QVector<XWAState> entries;
+    QVector<QString> status;    ///< result of the last change per entry
+    QVector<FleetJob> jobs;     ///< running save
+    QFutureWatcher<XWAState> scan_watcher;
+    QFutureWatcher<QString> save_watcher;
+};
+
+#endif
@@ -22,6 +22,9 @@
 #include <QLabel>
 #include <QMessageBox>
 #include <QPushButton>
+#include <QStatusBar>
+#include <QVector>
+#include <QtConcurrentRun>
 
 #include "xwahacker-qt.h"
 
@@ -68,7 +71,7 @@ static void addSpinBoxes(QGridLayout *grid, QSpinBox *(&sb)[4][2], QDoubleSpinBo
     }
 }
 
-static const char *opt_names[NUM_OPTS] = {
+const char * const opt_names[NUM_OPTS] = {
     [OPT_FIXED_CLEAR] = "Fix graphical corruption like disappearing objects",
     [OPT_FORCE_800] = "Use resolution marked 800x600 above regardless of in-game settings",
     [OPT_USE_32BIT] = "32 bit rendering, breaks load screens",
@@ -77,7 +80,7 @@ static const char *opt_names[NUM_OPTS] = {
     [OPT_MSGLOOP] = "Fix keyboard not working in hangar (Linux/WINE fix)",
 };
 
-static const char *showfps_names[] = {
+const char * const showfps_names[NUM_SHOWFPS] = {
     [SHOWFPS_DISABLED] = "Disabled",
     [SHOWFPS_FPS_ONLY] = "FPS only",
     [SHOWFPS_FPS_SCENESTATS] = "FPS and scene statistics",
@@ -134,6 +137,11 @@ XWAHacker::XWAHacker()
     central_widget->setLayout(main_layout);
     setCentralWidget(central_widget);
 
+    progress = new QProgressBar();
+    progress->setRange(0, 0);
+    progress->hide();
+    statusBar()->addPermanentWidget(progress);
+
     connect(res_spinboxes[0][0], SIGNAL(valueChanged(int)), this, SLOT(res0_change()));
     connect(res_spinboxes[0][1], SIGNAL(valueChanged(int)), this, SLOT(res0_change()));
     connect(res_spinboxes[1][0], SIGNAL(valueChanged(int)), this, SLOT(res1_change()));
@@ -155,43 +163,61 @@ XWAHacker::XWAHacker()
 
     connect(exit, SIGNAL(clicked()), qApp, SLOT(quit()));
     connect(save, SIGNAL(clicked()), this, SLOT(save()));
+    connect(&load_watcher, SIGNAL(finished()), this, SLOT(loadFinished()));
+    connect(&save_watcher, SIGNAL(finished()), this, SLOT(saveFinished()));
+}
+
+static const enum PATCHES optsmap[NUM_OPTS] = {
+    [OPT_FIXED_CLEAR] = PATCH_CLEAR2,
+    [OPT_FORCE_800] = PATCH_FORCE_RES,
+    [OPT_USE_32BIT] = PATCH_32BIT_FB,
+    [OPT_NOCD] = PATCH_NO_CD_CHECK,
+    [OPT_NOSTARS] = PATCH_STARS_OFF,
+    [OPT_MSGLOOP] = PATCH_ADD_MSGLOOP,
+};
+
+XWAState::XWAState() : readable(true), opts_supported(false), showfps(SHOWFPS_INVALID)
+{
+    memset(res, 0, sizeof(res));
+    memset(opts, 0, sizeof(opts));
 }
 
-bool XWAHacker::openBinary(const char *filename)
+/**
+ * Read all settings from the file, runs on a worker thread.
+ */
+static XWAState readState(const QString &filename, bool writable)
 {
-    xwa = fopen(filename, "r+b");
+    XWAState state;
+    QByteArray name = filename.toLocal8Bit();
+    struct exefile *xwa = exefile_open(name.constData(), writable);
     if (!xwa)
     {
-        QMessageBox err;
+        state.readable = false;
 #ifdef __WIN32__
-        err.setText(tr("Could not open file.\nTry running this program as administrator."));
+        state.error = QObject::tr("Could not open file.\nTry running this program as administrator.");
 #else
-        err.setText(tr("Could not open file"));
+        state.error = QObject::tr("Could not open file");
 #endif
-        err.exec();
-        return false;
+        return state;
     }
 
+    prefetch_all(xwa);
     uint8_t buffer[BUFFER_SZ];
-    int count = count_patches(buffer, xwa, binaries[0].patchgroups);
-    bool enable_opts = true;
-    if (count != num_patchgroups(binaries[0].patchgroups))
+    int count;
+    int b = detect_binary(buffer, xwa, &count);
+    if (count)
+        state.binary = binaries[b].name;
+    count = count_patches(buffer, xwa, binaries[0].patchgroups);
+    state.opts_supported = count == num_patchgroups(binaries[0].patchgroups);
+    if (!count)
     {
-        QMessageBox err;
-        err.setText(tr(count ? "File has unsupported modifications\nOptions disabled" : "Not a supported XWingAlliance binary"));
-        err.exec();
-        if (!count)
-            return false;
-        enable_opts = false;
-    }
-    for (int i = 0; i < NUM_OPTS; ++i)
-    {
-        opts[i]->setEnabled(enable_opts);
-    }
-    for (int i = 0; i < NUM_SHOWFPS; ++i)
-    {
-        showfps[i]->setEnabled(enable_opts);
+        state.error = QObject::tr("Not a supported XWingAlliance binary");
+        exefile_close(xwa);
+        return state;
     }
+    if (!state.opts_supported)
+        state.warning = QObject::tr("File has unsupported modifications\nOptions disabled");
+
     struct resopts resolutions[NUM_RES];
     read_res(buffer, xwa, resolutions);
     for (int i = 0; i < 4; ++i)
@@ -199,54 +225,271 @@ bool XWAHacker::openBinary(const char *filename)
         if (resolutions[i].w < 0 || resolutions[i].h < 0 ||
             resolutions[i].fov < 0 || resolutions[i].hud_scale.i == 0xffffffffu)
         {
-            QMessageBox err;
-            err.setText(tr("Unsupported binary, could not read resolution settings"));
-            err.exec();
-            return false;
+            state.error = QObject::tr("Unsupported binary, could not read resolution settings");
+            exefile_close(xwa);
+            return state;
         }
-        res_spinboxes[i][0]->setValue(resolutions[i].w);
-        res_spinboxes[i][1]->setValue(resolutions[i].h);
-        fov_hud_spinboxes[i][0]->setValue(fov2deg(resolutions[i].fov, resolutions[i].h));
-        fov_hud_spinboxes[i][1]->setValue(resolutions[i].hud_scale.f);
+        state.res[i].w = resolutions[i].w;
+        state.res[i].h = resolutions[i].h;
+        state.res[i].fov = resolutions[i].fov;
+        state.res[i].hud_scale = resolutions[i].hud_scale.f;
     }
 
     for (int i = 0; i < NUM_OPTS; ++i)
     {
-        enum PATCHES optsmap[NUM_OPTS] = {
-            [OPT_FIXED_CLEAR] = PATCH_CLEAR2,
-            [OPT_FORCE_800] = PATCH_FORCE_RES,
-            [OPT_USE_32BIT] = PATCH_32BIT_FB,
-            [OPT_NOCD] = PATCH_NO_CD_CHECK,
-            [OPT_NOSTARS] = PATCH_STARS_OFF,
-            [OPT_MSGLOOP] = PATCH_ADD_MSGLOOP,
-        };
-        opts[i]->setChecked(check_patch(buffer, xwa, optsmap[i], 1));
+        state.opts[i] = check_patch(buffer, xwa, optsmap[i], 1);
     }
     if (check_patch(buffer, xwa, PATCH_NO_CD_CHECK2, 1))
     {
-        opts[OPT_NOCD]->setChecked(true);
+        state.opts[OPT_NOCD] = true;
     }
 
-    enum ShowFPS showfps_mode = SHOWFPS_DISABLED;
+    state.showfps = SHOWFPS_DISABLED;
     if (check_patch(buffer, xwa, PATCH_SHOWFPS_FPS, 1))
     {
-        showfps_mode = SHOWFPS_FPS_ONLY;
+        state.showfps = SHOWFPS_FPS_ONLY;
     }
     else if (check_patch(buffer, xwa, PATCH_SHOWFPS_FPS_SCENESTATS, 1))
     {
-        showfps_mode = SHOWFPS_FPS_SCENESTATS;
+        state.showfps = SHOWFPS_FPS_SCENESTATS;
     }
     else if (check_patch(buffer, xwa, PATCH_SHOWFPS_FPS_TEXSTATS, 1))
     {
-        showfps_mode = SHOWFPS_FPS_TEXSTATS;
+        state.showfps = SHOWFPS_FPS_TEXSTATS;
+    }
+    exefile_close(xwa);
+    return state;
+}
+
+XWAState loadState(const QString &filename)
+{
+    // open writable so that missing permissions are reported right away
+    return readState(filename, true);
+}
+
+/**
+ * Like loadState, but only reads the file, so that read-only installs
+ * are still detected. Missing write permission is reported as error.
+ */
+XWAState scanState(const QString &filename)
+{
+    XWAState state = readState(filename, false);
+    if (state.binary.isEmpty() || !state.error.isEmpty())
+        return state;
+    QByteArray name = filename.toLocal8Bit();
+    struct exefile *xwa = exefile_open(name.constData(), 1);
+    if (xwa)
+        exefile_close(xwa);
+    else
+        state.error = QObject::tr("Read-only, no permission to change the file");
+    return state;
+}
+
+/**
+ * \return resolution w x h with the default FOV and HUD scale for it
+ */
+XWAResolution defaultResolution(int w, int h)
+{
+    XWAResolution r;
+    r.w = w;
+    r.h = h;
+    r.fov = default_fov(h);
+    r.hud_scale = default_hud_scale(h);
+    return r;
+}
+
+static const int opt2collection[NUM_OPTS][2] = {
+    [OPT_FIXED_CLEAR] = {2, 3},
+    [OPT_FORCE_800] = {4, 5},
+    [OPT_USE_32BIT] = {0, 1},
+    [OPT_NOCD] = {6, 7},
+    [OPT_NOSTARS] = {-PATCH_STARS_ON, -PATCH_STARS_OFF},
+    [OPT_MSGLOOP] = {-PATCH_NO_MSGLOOP, -PATCH_ADD_MSGLOOP},
+};
+
+static const int showfps2collection = 8;
+
+static void addRange(QVector<struct range> &ranges, int offset, int len)
+{
+    struct range r;
+    r.offset = offset;
+    r.len = len;
+    ranges.append(r);
+}
+
+/**
+ * Add the ranges apply_patch needs to read for patch.
+ */
+static void addPatchRanges(QVector<struct range> &ranges, enum PATCHES patch)
+{
+    const enum PATCHES *group = find_patchgroup(binaries[0].patchgroups, patch);
+    for (int i = 0; group && group[i] != NO_PATCH; ++i)
+        addRange(ranges, patchdescs[group[i]].offset, patchdescs[group[i]].len);
+}
+
+static void addCollectionRanges(QVector<struct range> &ranges, int c)
+{
+    for (int i = 0; xwa_collections[c].patches[i] != NO_PATCH; ++i)
+        addPatchRanges(ranges, xwa_collections[c].patches[i]);
+}
+
+static bool applyOption(uint8_t *buffer, struct exefile *xwa, int collection)
+{
+    if (collection < 0)
+        return apply_patch(buffer, xwa, binaries[0].patchgroups, static_cast<enum PATCHES>(-collection));
+    return apply_collection(buffer, xwa, binaries, collection);
+}
+
+/**
+ * Write the settings that differ between old and state to the file,
+ * runs on a worker thread.
+ * Only the data needed for the changed settings is read and written, all
+ * changes are collected and only written at the end, nothing is written
+ * if any of them fails.
+ * \return error message, empty on success
+ */
+QString saveState(const QString &filename, const XWAState &old, const XWAState &state)
+{
+    bool res_changed[4][PARAMS_PER_RES];
+    bool opt_changed[NUM_OPTS];
+    bool showfps_changed = state.opts_supported && state.showfps != old.showfps;
+    QVector<struct range> ranges;
+
+    for (int i = 0; i < 4; ++i)
+    {
+        const XWAResolution &o = old.res[i];
+        const XWAResolution &n = state.res[i];
+        res_changed[i][PARAM_RES_W] = n.w != o.w;
+        res_changed[i][PARAM_RES_H] = n.h != o.h;
+        res_changed[i][PARAM_RES_HUD_SCALE] = memcmp(&n.hud_scale, &o.hud_scale, sizeof(float)) != 0;
+        res_changed[i][PARAM_RES_FOV] = n.fov != o.fov;
+        for (int j = 0; j < PARAMS_PER_RES; ++j)
+        {
+            const struct paramdesc *p = &paramdescs[i * PARAMS_PER_RES + j];
+            if (res_changed[i][j])
+                addRange(ranges, p->offset, p->len + param_size(p->type));
+        }
+    }
+    for (int i = 0; i < NUM_OPTS; ++i)
+    {
+        int collection = opt2collection[i][state.opts[i]];
+        opt_changed[i] = state.opts_supported && state.opts[i] != old.opts[i];
+        if (!opt_changed[i])
+            continue;
+        if (collection < 0)
+            addPatchRanges(ranges, static_cast<enum PATCHES>(-collection));
+        else
+            addCollectionRanges(ranges, collection);
+    }
+    if (showfps_changed && state.showfps != SHOWFPS_INVALID)
+        addCollectionRanges(ranges, showfps2collection + state.showfps);
+    if (showfps_changed && state.showfps == SHOWFPS_INVALID)
+        return QObject::tr("Failed setting FPS display mode");
+    if (ranges.isEmpty())
+        return QString();
+
+    QByteArray name = filename.toLocal8Bit();
+    struct exefile *xwa = exefile_open(name.constData(), 1);
+    if (!xwa)
+        return QObject::tr("Could not open file");
+    exefile_prefetch(xwa, ranges.data(), ranges.size());
+
+    uint8_t buffer[BUFFER_SZ];
+    QString error;
+    for (int i = 0; i < 4 && error.isEmpty(); ++i)
+    {
+        const XWAResolution &n = state.res[i];
+        uint32_t values[PARAMS_PER_RES];
+        values[PARAM_RES_W] = n.w;
+        values[PARAM_RES_H] = n.h;
+        memcpy(&values[PARAM_RES_HUD_SCALE], &n.hud_scale, sizeof(float));
+        values[PARAM_RES_FOV] = n.fov;
+        for (int j = 0; j < PARAMS_PER_RES && error.isEmpty(); ++j)
+        {
+            enum PARAMS param = static_cast<enum PARAMS>(i * PARAMS_PER_RES + j);
+            uint32_t current;
+            if (res_changed[i][j] &&
+                (!read_param(buffer, xwa, param, &current) ||
+                 !write_param(buffer, xwa, param, values[j])))
+                error = QObject::tr("Failed writing resolution values");
+        }
+    }
+    for (int i = 0; i < NUM_OPTS && error.isEmpty(); ++i)
+    {
+        if (opt_changed[i] && !applyOption(buffer, xwa, opt2collection[i][state.opts[i]]))
+        {
+            error = QObject::tr("Failed setting option") + QObject::tr(opt_names[i]);
+        }
+    }
+    if (showfps_changed && error.isEmpty() &&
+        !apply_collection(buffer, xwa, binaries, showfps2collection + state.showfps))
+    {
+        error = QObject::tr("Failed setting FPS display mode");
+    }
+    if (!error.isEmpty())
+        exefile_discard(xwa);
+    if (!exefile_close(xwa) && error.isEmpty())
+        error = QObject::tr("Failed writing changes to file");
+    return error;
+}
+
+void XWAHacker::setBusy(const QString &msg)
+{
+    centralWidget()->setEnabled(msg.isEmpty());
+    progress->setVisible(!msg.isEmpty());
+    if (msg.isEmpty())
+        statusBar()->clearMessage();
+    else
+        statusBar()->showMessage(msg);
+}
+
+void XWAHacker::openBinary(const QString &name)
+{
+    filename = name;
+    setBusy(tr("Loading %1...").arg(filename));
+    load_watcher.setFuture(QtConcurrent::run(loadState, filename));
+}
+
+void XWAHacker::loadFinished()
+{
+    setBusy(QString());
+    XWAState state = load_watcher.result();
+    if (!state.error.isEmpty())
+    {
+        QMessageBox err(this);
+        err.setText(state.error);
+        err.exec();
+        qApp->exit(1);
+        return;
+    }
+    if (!state.warning.isEmpty())
+    {
+        QMessageBox err(this);
+        err.setText(state.warning);
+        err.exec();
+    }
+    loaded = state;
+
+    for (int i = 0; i < NUM_OPTS; ++i)
+    {
+        opts[i]->setEnabled(state.opts_supported);
+        opts[i]->setChecked(state.opts[i]);
     }
     for (int i = 0; i < NUM_SHOWFPS; ++i)
     {
-        showfps[i]->setChecked(i == showfps_mode);
+        showfps[i]->setEnabled(state.opts_supported);
+        showfps[i]->setChecked(i == state.showfps);
+    }
+    for (int i = 0; i < 4; ++i)
+    {
+        const XWAResolution &r = state.res[i];
+        res_spinboxes[i][0]->setValue(r.w);
+        res_spinboxes[i][1]->setValue(r.h);
+        fov_hud_spinboxes[i][0]->setValue(fov2deg(r.fov, r.h));
+        fov_hud_spinboxes[i][1]->setValue(r.hud_scale);
     }
 
     reset_update();
-    return true;
 }
 
 void XWAHacker::res_change(int i)
@@ -311,94 +554,73 @@ void XWAHacker::res3_reset()
     res_reset(3);
 }
 
-void XWAHacker::save()
+/**
+ * Settings as currently shown in the window.
+ */
+XWAState XWAHacker::currentState() const
 {
-    uint8_t buffer[BUFFER_SZ];
-    struct resopts resolutions[NUM_RES];
-    read_res(buffer, xwa, resolutions);
+    XWAState state;
     for (int i = 0; i < 4; ++i)
     {
-        resolutions[i].w = res_spinboxes[i][0]->value();
-        resolutions[i].h = res_spinboxes[i][1]->value();
-        int h = resolutions[i].h;
+        const XWAResolution &o = loaded.res[i];
+        XWAResolution &r = state.res[i];
+        r.w = res_spinboxes[i][0]->value();
+        r.h = res_spinboxes[i][1]->value();
+        int h = r.h;
         double deffov = fov2deg(default_fov(h), h);
         double fov = fov_hud_spinboxes[i][0]->value();
-        if (fov > deffov - 0.015 && fov < deffov + 0.015)
-            resolutions[i].fov = default_fov(h);
+        // keep untouched values exactly, the spin boxes round them
+        if (h == o.h && fabs(fov - fov2deg(o.fov, h)) < 0.005)
+            r.fov = o.fov;
+        else if (fov > deffov - 0.015 && fov < deffov + 0.015)
+            r.fov = default_fov(h);
         else
-            resolutions[i].fov = deg2fov(fov, h);
+            r.fov = deg2fov(fov, h);
         float defhud = default_hud_scale(h);
         double hud = fov_hud_spinboxes[i][1]->value();
-        if (hud > defhud - 0.015 && hud < defhud + 0.015)
-            resolutions[i].hud_scale.f = defhud;
+        if (h == o.h && fabs(hud - o.hud_scale) < 0.005)
+            r.hud_scale = o.hud_scale;
+        else if (hud > defhud - 0.015 && hud < defhud + 0.015)
+            r.hud_scale = defhud;
         else
-            resolutions[i].hud_scale.f = hud;
-        if (!write_res(buffer, xwa, resolutions + i, i, 0, 0))
-        {
-            QMessageBox err(this);
-            err.setText(tr("Failed writing resolution values"));
-            err.exec();
-            return;
-        }
+            r.hud_scale = hud;
     }
+    state.opts_supported = loaded.opts_supported;
     for (int i = 0; i < NUM_OPTS; ++i)
     {
-        if (!opts[i]->isEnabled())
+        state.opts[i] = opts[i]->isChecked();
+    }
+    for (int i = 0; i < NUM_SHOWFPS; ++i)
+    {
+        if (!showfps[i]->isChecked())
             continue;
-        bool c = opts[i]->isChecked();
-        int opt2collection[NUM_OPTS][2] = {
-            [OPT_FIXED_CLEAR] = {2, 3},
-            [OPT_FORCE_800] = {4, 5},
-            [OPT_USE_32BIT] = {0, 1},
-            [OPT_NOCD] = {6, 7},
-            [OPT_NOSTARS] = {-PATCH_STARS_ON, -PATCH_STARS_OFF},
-            [OPT_MSGLOOP] = {-PATCH_NO_MSGLOOP, -PATCH_ADD_MSGLOOP},
-        };
-        int collection = opt2collection[i][c];
-        int res = 0;
-        if (collection < 0)
+        // exactly one must be selected
+        if (state.showfps != SHOWFPS_INVALID)
         {
-            res = apply_patch(buffer, xwa, binaries[0].patchgroups, static_cast<enum PATCHES>(-collection));
-        }
-        else
-        {
-            res = apply_collection(buffer, xwa, binaries, collection);
-        }
-        if (!res)
-        {
-            QMessageBox err(this);
-            err.setText(tr("Failed setting option") + tr(opt_names[i]));
-            err.exec();
-            return;
+            state.showfps = SHOWFPS_INVALID;
+            break;
         }
+        state.showfps = static_cast<ShowFPS>(i);
     }
-    if (showfps[0]->isEnabled())
+    return state;
+}
+
+void XWAHacker::save()
+{
+    setBusy(tr("Saving %1...").arg(filename));
+    save_watcher.setFuture(QtConcurrent::run(saveState, filename, loaded, currentState()));
+}
+
+void XWAHacker::saveFinished()
+{
+    setBusy(QString());
+    QString error = save_watcher.result();
+    if (!error.isEmpty())
     {
-        int res = 0;
-        int collection = -1;
-        for (int i = 0; i < NUM_SHOWFPS; ++i)
-        {
-            if (showfps[i]->isChecked())
-            {
-                if (collection != -1)
-                {
-                    collection = -2;
-                    break;
-                }
-                collection = 8 + i;
-            }
-        }
-        if (collection >= 0)
-        {
-            res = apply_collection(buffer, xwa, binaries, collection);
-        }
-        if (!res)
-        {
-            QMessageBox err(this);
-            err.setText(tr("Failed setting FPS display mode"));
-            err.exec();
-            return;
-        }
+        QMessageBox err(this);
+        err.setText(error);
+        err.exec();
+        return;
     }
     QMessageBox done(this);
     done.setText(tr("Changes saved successfully!"));
@@ -21,7 +21,9 @@
 
 #include <QCheckBox>
 #include <QDoubleSpinBox>
+#include <QFutureWatcher>
 #include <QMainWindow>
+#include <QProgressBar>
 #include <QPushButton>
 #include <QRadioButton>
 #include <QSpinBox>
@@ -37,6 +39,7 @@ enum {
 };
 
 enum ShowFPS {
+    SHOWFPS_INVALID = -1,
     SHOWFPS_DISABLED = 0,
     SHOWFPS_FPS_ONLY,
     SHOWFPS_FPS_SCENESTATS,
@@ -44,6 +47,39 @@ enum ShowFPS {
     NUM_SHOWFPS
 };
 
+struct XWAResolution
+{
+    int w;
+    int h;
+    int fov;
+    float hud_scale;
+};
+
+/**
+ * Snapshot of all settings of an xwingalliance.exe, as read from the file
+ * or as they should be written to it.
+ */
+struct XWAState
+{
+    XWAState();
+    QString binary;  ///< name of the detected binary, empty if unknown
+    bool readable;   ///< false if the file could not be opened at all
+    QString error;   ///< loading or saving failed if not empty
+    QString warning; ///< loaded, but with restrictions
+    bool opts_supported;
+    XWAResolution res[4];
+    bool opts[NUM_OPTS];
+    ShowFPS showfps;
+};
+
+extern const char * const opt_names[NUM_OPTS];
+extern const char * const showfps_names[NUM_SHOWFPS];
+
+XWAState loadState(const QString &filename);
+XWAState scanState(const QString &filename);
+QString saveState(const QString &filename, const XWAState &old, const XWAState &state);
+XWAResolution defaultResolution(int w, int h);
+
 class XWAHacker : public QMainWindow
 {
     Q_OBJECT
@@ -51,7 +87,7 @@ class XWAHacker : public QMainWindow
 public:
     XWAHacker();
     virtual ~XWAHacker() {}
-    bool openBinary(const char *filename);
+    void openBinary(const QString &filename);
 
 private slots:
     void res0_change();
@@ -64,16 +100,24 @@ private slots:
     void res3_reset();
     void reset_update();
     void save();
+    void loadFinished();
+    void saveFinished();
 
 private:
     void res_change(int i);
     void res_reset(int i);
+    void setBusy(const QString &msg);
+    XWAState currentState() const;
     QSpinBox *res_spinboxes[4][2];
     QDoubleSpinBox *fov_hud_spinboxes[4][2];
     QPushButton *res_reset_buttons[4];
     QCheckBox *opts[NUM_OPTS];
     QRadioButton *showfps[NUM_SHOWFPS];
-    FILE *xwa;
+    QProgressBar *progress;
+    QString filename;
+    XWAState loaded; ///< as in the file, to only save changes
+    QFutureWatcher<XWAState> load_watcher;
+    QFutureWatcher<QString> save_watcher;
 };
 
 #endif
@@ -1,4 +1,4 @@
-QT += widgets
+QT += widgets concurrent
 CONFIG += release
 CONFIG -= exceptions rtti
 static {
@@ -6,5 +6,5 @@ QMAKE_LFLAGS += -static-libgcc -static-libstdc++
 }
 win32: QMAKE_LFLAGS += -Wl,--dynamicbase -Wl,--nxcompat
 
-HEADERS = xwahacker-qt.h
-SOURCES = main.cpp xwahacker-qt.cpp
+HEADERS = xwahacker-qt.h xwahacker-fleet.h
+SOURCES = main.cpp xwahacker-qt.cpp xwahacker-fleet.cpp
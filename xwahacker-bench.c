@@ -0,0 +1,355 @@
+/*
+ * Benchmarks for XWAHacker detection and patching on a synthetic corpus.
+ * Copyright (C) 2026 Reimar Döffinger
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+// for wait4
+#define _DEFAULT_SOURCE 1
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <utime.h>
+
+#define NO_MAIN 1
+#include "xwahacker.c"
+
+/*
+ * Each corpus file is a sparse file that only contains data where
+ * xwahacker looks, cycling through these variants.
+ */
+enum VARIANT {
+  VARIANT_ORIGINAL = 0, ///< all patch groups in the unmodified state
+  VARIANT_PATCHED,      ///< random state for every patch group
+  VARIANT_NOISE,        ///< like original, but some groups overwritten with garbage
+  VARIANT_SHIFTED,      ///< original data at slightly wrong offsets, not detectable
+  NUM_VARIANTS
+};
+
+static uint32_t rnd_state = 1;
+static uint32_t rnd(void) {
+  rnd_state = rnd_state * 1664525 + 1013904223;
+  return rnd_state >> 8;
+}
+
+static void put(uint8_t *img, int size, int offset, const void *data, int len) {
+  if (offset >= 0 && offset + len <= size)
+    memcpy(img + offset, data, len);
+}
+
+static int image_size(const struct binary *binary) {
+  const enum PATCHES *g = binary->patchgroups;
+  int size = 0;
+  int i;
+  for (i = 0; g[i] != NO_PATCH || g[i + 1] != NO_PATCH; i++)
+    if (g[i] != NO_PATCH && patchdescs[g[i]].offset + patchdescs[g[i]].len > size)
+      size = patchdescs[g[i]].offset + patchdescs[g[i]].len;
+  for (i = 0; binary == &binaries[0] && i < NUM_PARAMS; i++)
+    if (paramdescs[i].offset + paramdescs[i].len + 4 > size)
+      size = paramdescs[i].offset + paramdescs[i].len + 4;
+  return (size + 0xfff) & ~0xfff;
+}
+
+/**
+ * Synthesize a fake executable for binaries[b] in the given variant.
+ * \return 0 on failure
+ */
+static int generate_file(const char *name, int b, enum VARIANT v) {
+  const struct binary *binary = &binaries[b];
+  const enum PATCHES *g = binary->patchgroups;
+  int size = image_size(binary);
+  int shift = v == VARIANT_SHIFTED ? 1 + rnd() % 16 : 0;
+  uint8_t *img = (uint8_t *)calloc(1, size);
+  int i = 0;
+  int res;
+  FILE *f;
+  while (g[i] != NO_PATCH) {
+    const enum PATCHES *group = &g[i];
+    int n = 0;
+    enum PATCHES p = NO_PATCH;
+    for (; g[i] != NO_PATCH; i++, n++)
+      if (patchdescs[g[i]].original && p == NO_PATCH)
+        p = g[i];
+    if (v == VARIANT_PATCHED || p == NO_PATCH)
+      p = group[rnd() % n];
+    put(img, size, patchdescs[p].offset + shift, patchdescs[p].value, patchdescs[p].len);
+    if (v == VARIANT_NOISE && rnd() % 4 == 0) {
+      int j;
+      for (j = 0; j < patchdescs[p].len; j++)
+        put(img, size, patchdescs[p].offset + j, (uint8_t[1]){rnd()}, 1);
+    }
+    i++;
+  }
+  for (i = 0; b == 0 && i < NUM_PARAMS; i++) {
+    const struct paramdesc *p = &paramdescs[i];
+    uint8_t tmp[4];
+    WL32(tmp, p->original);
+    put(img, size, p->offset + shift, p->opcode, p->len);
+    put(img, size, p->offset + p->len + shift, tmp, param_size(p->type));
+  }
+
+  // only write non-zero pages to keep large corpora sparse
+  f = fopen(name, "wb");
+  res = !!f;
+  for (i = 0; f && i < size; i += 4096) {
+    int j;
+    for (j = 0; j < 4096 && !img[i + j]; j++) /* */;
+    if (j < 4096 && (fseek(f, i, SEEK_SET) || fwrite(img + i, 1, 4096, f) != 4096))
+      res = 0;
+  }
+  if (f && (ftruncate(fileno(f), size) || fclose(f)))
+    res = 0;
+  free(img);
+  return res;
+}
+
+static void corpus_name(char *name, int len, const char *dir, int i) {
+  snprintf(name, len, "%s/%06i-%s", dir, i, binaries[i % (int)(sizeof(binaries) / sizeof(*binaries) - 1)].filename);
+}
+
+static int generate_corpus(const char *dir, int num) {
+  int num_binaries = sizeof(binaries) / sizeof(*binaries) - 1;
+  int i;
+  mkdir(dir, 0777);
+  rnd_state = 1;
+  for (i = 0; i < num; i++) {
+    char name[1024];
+    corpus_name(name, sizeof(name), dir, i);
+    if (!generate_file(name, i % num_binaries, (enum VARIANT)(i / num_binaries % NUM_VARIANTS))) {
+      fprintf(stderr, "Could not write corpus file %s\n", name);
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+enum BENCH {
+  BENCH_DETECT,
+  BENCH_COLLECTION,
+  BENCH_RES,
+  BENCH_BATCH,
+  NUM_BENCHES
+};
+
+static const char * const benchnames[NUM_BENCHES] = {
+  [BENCH_DETECT]     = "detect",
+  [BENCH_COLLECTION] = "apply_collection",
+  [BENCH_RES]        = "read_write_res",
+  [BENCH_BATCH]      = "batch",
+};
+
+/**
+ * Run one benchmark on a single file.
+ * \return 1 if the file was processed successfully
+ */
+static int bench_file(enum BENCH bench, const char *name, int iteration) {
+  uint8_t buffer[BUFFER_SZ];
+  struct resopts res[NUM_RES];
+  struct exefile *f = exefile_open(name, bench != BENCH_DETECT);
+  int count;
+  int b;
+  int ok = 0;
+  if (!f)
+    return 0;
+  prefetch_all(f);
+  b = detect_binary(buffer, f, &count);
+  switch (bench) {
+  case BENCH_DETECT:
+    ok = count > 0;
+    break;
+  case BENCH_COLLECTION:
+    // toggle the Z-buffer clear fix
+    ok = b == 0 && count > 0 && apply_collection(buffer, f, &binaries[0], 2 + (iteration & 1));
+    break;
+  case BENCH_RES:
+    if (b != 0 || !count)
+      break;
+    read_res(buffer, f, res);
+    res[1].w = iteration & 1 ? 1920 : 800;
+    res[1].h = iteration & 1 ? 1080 : 600;
+    ok = write_res(buffer, f, res + 1, 1, 0, 0);
+    break;
+  case BENCH_BATCH:
+    // what a batch run over many installs does: detect, apply a metapatch
+    ok = count > 0 && apply_metapatch(buffer, f, &binaries[b], iteration & 1);
+    break;
+  default:
+    break;
+  }
+  if (!exefile_close(f))
+    ok = 0;
+  return ok;
+}
+
+static void run_bench(FILE *out, enum BENCH bench, const char *dir, int num, int iterations) {
+  double start, elapsed;
+  int ok = 0;
+  int it, i;
+  start = now();
+  for (it = 0; it < iterations; it++) {
+    for (i = 0; i < num; i++) {
+      char name[1024];
+      corpus_name(name, sizeof(name), dir, i);
+      ok += bench_file(bench, name, it);
+    }
+  }
+  elapsed = now() - start;
+  fprintf(out, "{\"bench\": \"%s\", \"files\": %i, \"iterations\": %i, \"ok\": %i, "
+               "\"seconds\": %.6f, \"us_per_file\": %.3f}\n",
+          benchnames[bench], num, iterations, ok, elapsed, elapsed * 1e6 / (num * iterations));
+  fflush(out);
+}
+
+enum STARTUP_CMD {
+  STARTUP_DETECT,
+  STARTUP_DETECT_CACHED,
+  STARTUP_LIST,
+  STARTUP_PATCH,
+  NUM_STARTUP_CMDS
+};
+
+static const char * const startupnames[NUM_STARTUP_CMDS] = {
+  [STARTUP_DETECT]        = "detect",
+  [STARTUP_DETECT_CACHED] = "detect-cached",
+  [STARTUP_LIST]          = "list",
+  [STARTUP_PATCH]         = "patch",
+};
+
+/**
+ * Run a program once with its output discarded.
+ * \param env XWAHACKER_CACHE setting for the program
+ * \return 1 if it exited successfully
+ */
+static int run_program(char *const args[], char *env, struct rusage *usage) {
+  int status;
+  pid_t pid = fork();
+  if (pid < 0)
+    return 0;
+  if (pid == 0) {
+    int fd = open("/dev/null", O_WRONLY);
+    dup2(fd, 1);
+    dup2(fd, 2);
+    putenv(env);
+    execv(args[0], args);
+    _exit(127);
+  }
+  if (wait4(pid, &status, 0, usage) != pid)
+    return 0;
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/**
+ * Measure exec-to-exit latency and peak RSS of whole xwahacker runs,
+ * which is what scripts calling it for many files pay.
+ */
+static int startup_main(FILE *out, int runs, char *progs[], int num_progs) {
+  static char file[] = "bench-corpus/startup-xwingalliance.exe";
+  static char list_opt[] = "-l";
+  static char collection_opt[] = "-c";
+  static char collection_nums[2][2] = {"2", "3"};
+  // never touch the user's cache, and only use one for detect-cached
+  static char no_cache_env[] = "XWAHACKER_CACHE=";
+  static char cache_env[] = "XWAHACKER_CACHE=bench-corpus/startup-cache.txt";
+  int i;
+  mkdir("bench-corpus", 0777);
+  if (!generate_file(file, 0, VARIANT_ORIGINAL)) {
+    fprintf(stderr, "Could not write %s\n", file);
+    return 1;
+  }
+  for (i = 0; i < num_progs; i++) {
+    enum STARTUP_CMD cmd;
+    for (cmd = STARTUP_DETECT; cmd < NUM_STARTUP_CMDS; cmd = (enum STARTUP_CMD)(cmd + 1)) {
+      long max_rss = 0;
+      double start, elapsed;
+      int ok = 0;
+      int run;
+      char *env = cmd == STARTUP_DETECT_CACHED ? cache_env : no_cache_env;
+      if (cmd == STARTUP_DETECT_CACHED) {
+        // an entry for a file modified in the same second is checked
+        // against the file on every run, so make the file older first
+        char *args[3] = {progs[i], file, NULL};
+        struct utimbuf times;
+        struct rusage usage;
+        times.actime = times.modtime = time(NULL) - 60;
+        remove(cache_env + strlen("XWAHACKER_CACHE="));
+        utime(file, &times);
+        run_program(args, env, &usage);
+      }
+      start = now();
+      for (run = 0; run < runs; run++) {
+        // toggle the Z-buffer clear fix so that every patch run writes
+        char *args[5] = {progs[i], file, NULL, NULL, NULL};
+        struct rusage usage;
+        if (cmd == STARTUP_LIST) {
+          args[2] = list_opt;
+        } else if (cmd == STARTUP_PATCH) {
+          args[2] = collection_opt;
+          args[3] = collection_nums[run & 1];
+        }
+        memset(&usage, 0, sizeof(usage));
+        ok += run_program(args, env, &usage);
+        if (usage.ru_maxrss > max_rss)
+          max_rss = usage.ru_maxrss;
+      }
+      elapsed = now() - start;
+      fprintf(out, "{\"bench\": \"startup\", \"program\": \"%s\", \"command\": \"%s\", \"runs\": %i, "
+                   "\"ok\": %i, \"us_per_run\": %.1f, \"max_rss_kb\": %li}\n",
+              progs[i], startupnames[cmd], runs, ok, elapsed * 1e6 / runs, max_rss);
+      fflush(out);
+    }
+  }
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  const char *dir = argc > 1 ? argv[1] : "bench-corpus";
+  int max_files = argc > 2 ? atoi(argv[2]) : 1000;
+  int num;
+  FILE *out;
+  if (argc > 3 && strcmp(argv[1], "--startup") == 0 && atoi(argv[2]) > 0)
+    return startup_main(stdout, atoi(argv[2]), argv + 3, argc - 3);
+  if (argc > 3 || max_files < 1) {
+    fprintf(stderr, "Usage: %s [corpus directory] [maximum number of files]\n", argv[0]);
+    fprintf(stderr, "       %s --startup <runs> <xwahacker binary>...\n", argv[0]);
+    return 1;
+  }
+  // results go to stdout, the patching messages are discarded
+  out = fdopen(dup(1), "w");
+  if (!out || !freopen("/dev/null", "w", stdout))
+    return 1;
+  if (!generate_corpus(dir, max_files))
+    return 1;
+  // corpus sizes 1, 10, 100, ... up to max_files
+  for (num = 1; ; num *= 10) {
+    enum BENCH bench;
+    int iterations;
+    if (num > max_files)
+      num = max_files;
+    iterations = num < 1000 ? 1000 / num : 1;
+    for (bench = BENCH_DETECT; bench < NUM_BENCHES; bench = (enum BENCH)(bench + 1))
+      run_bench(out, bench, dir, num, iterations);
+    if (num == max_files)
+      break;
+  }
+  fclose(out);
+  return 0;
+}
@@ -22,6 +22,20 @@
 #include <stdint.h>
 #include <assert.h>
 #include <math.h>
+#include <time.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <sys/wait.h>
+#include <poll.h>
+#endif
 
 #define DEBUG 0
 
@@ -29,17 +43,15 @@
 
 #define NUM_RES 4
 static const struct {
-  int offset;
-  int fov_offset;
   int width;
   int height;
 } resdes[NUM_RES] = {
-  {0x10a3dd, 0x10f422,  640,  480}, // 0
-  {0x10a334, 0x10f44f,  800,  600}, // 1
+  { 640,  480}, // 0
+  { 800,  600}, // 1
 // 2: 1024x768
-  {0x10a37c, 0x10f4a6, 1152,  864}, // 3
+  {1152,  864}, // 3
 // 4: 1280x1024
-  {0x10a3bb, 0x10f4fa, 1600, 1200}, // 5
+  {1600, 1200}, // 5
 };
 
 static uint32_t RL32(const void *ptr) {
@@ -55,27 +67,421 @@ static void WL32(void *ptr, uint32_t v) {
   p[0] = v;
 }
 
+enum COUNTER {
+  CNT_READ_BUFFER,
+  CNT_READ_CACHED,
+  CNT_WRITE_BUFFER,
+  CNT_SEEKS,
+  CNT_READS,
+  CNT_WRITES,
+  CNT_BYTES_READ,
+  CNT_BYTES_WRITTEN,
+  CNT_CHECK_PATCH,
+  CNT_APPLY_PATCH,
+  CNT_COUNT_PATCHES,
+  CNT_RESOLUTION,
+  NUM_COUNTERS
+};
+
+static const char * const counternames[NUM_COUNTERS] = {
+  [CNT_READ_BUFFER]   = "read_buffer calls",
+  [CNT_READ_CACHED]   = "  served from prefetched data",
+  [CNT_WRITE_BUFFER]  = "write_buffer calls",
+  [CNT_SEEKS]         = "seeks",
+  [CNT_READS]         = "reads",
+  [CNT_WRITES]        = "writes",
+  [CNT_BYTES_READ]    = "bytes read",
+  [CNT_BYTES_WRITTEN] = "bytes written",
+  [CNT_CHECK_PATCH]   = "check_patch calls",
+  [CNT_APPLY_PATCH]   = "apply_patch calls",
+  [CNT_COUNT_PATCHES] = "count_patches calls",
+  [CNT_RESOLUTION]    = "resolution reads/writes",
+};
+
+enum PHASE {
+  PHASE_DETECTION,
+  PHASE_PLANNING,
+  PHASE_COMMIT,
+  NUM_PHASES
+};
+
+static const char * const phasenames[NUM_PHASES] = {
+  [PHASE_DETECTION] = "detection",
+  [PHASE_PLANNING]  = "planning",
+  [PHASE_COMMIT]    = "commit",
+};
+
+struct trace_event {
+  const char *name;
+  int64_t ts;
+  int64_t dur;
+  int offset;
+  int len;
+};
+
+struct stats {
+  int64_t counters[NUM_COUNTERS];
+  int64_t phase_us[NUM_PHASES];
+  int num_events;
+  struct trace_event *events; ///< only collected if trace is set
+  const char *trace;
+};
+
+/// NULL unless statistics were requested, then everything below is a no-op
+static struct stats *stats;
+
+#define COUNT(c, n) do { if (stats) stats->counters[c] += (n); } while (0)
+
+static int64_t time_us(void) {
+#ifdef _WIN32
+  return (int64_t)clock() * 1000000 / CLOCKS_PER_SEC;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+/// \return start time for trace_end, 0 if not collecting statistics
+static int64_t trace_start(void) {
+  return stats ? time_us() : 0;
+}
+
+/**
+ * Record an event that started at start.
+ * offset and len are only informational, -1 if not applicable.
+ */
+static void trace_end(const char *name, int64_t start, int offset, int len) {
+  struct trace_event *e;
+  if (!stats || !stats->trace)
+    return;
+  if (!(stats->num_events & (stats->num_events - 1)))
+    stats->events = (struct trace_event *)realloc(stats->events, 2 * (stats->num_events + 1) * sizeof(*e));
+  e = &stats->events[stats->num_events++];
+  e->name = name;
+  e->ts = start;
+  e->dur = time_us() - start;
+  e->offset = offset;
+  e->len = len;
+}
+
+static void phase_end(enum PHASE phase, int64_t start) {
+  if (!stats)
+    return;
+  stats->phase_us[phase] += time_us() - start;
+  trace_end(phasenames[phase], start, -1, -1);
+}
+
+static void print_stats(void) {
+  int i;
+  printf("\nI/O statistics:\n");
+  for (i = 0; i < NUM_COUNTERS; i++)
+    printf("%-30s %10lld\n", counternames[i], (long long)stats->counters[i]);
+  for (i = 0; i < NUM_PHASES; i++)
+    printf("%-30s %10.3f ms\n", phasenames[i], stats->phase_us[i] / 1000.0);
+}
+
+/**
+ * Write collected events in Chrome trace event format,
+ * viewable in chrome://tracing or Perfetto.
+ * \return 0 on error
+ */
+static int write_trace(const char *name) {
+  int i;
+  FILE *f = fopen(name, "w");
+  if (!f)
+    return 0;
+  fprintf(f, "{\"traceEvents\": [\n");
+  for (i = 0; i < stats->num_events; i++) {
+    const struct trace_event *e = &stats->events[i];
+    fprintf(f, "  {\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": 1, "
+               "\"ts\": %lld, \"dur\": %lld", e->name, (long long)e->ts, (long long)e->dur);
+    if (e->offset >= 0)
+      fprintf(f, ", \"args\": {\"offset\": %i, \"len\": %i}", e->offset, e->len);
+    fprintf(f, "}%s\n", i + 1 < stats->num_events ? "," : "");
+  }
+  fprintf(f, "], \"displayTimeUnit\": \"ms\"}\n");
+  return fclose(f) == 0;
+}
+
 #define BUFFER_SZ 1024
+/// number of bytes at the start of a file that identify it in a patch database
+#define FINGERPRINT_LEN 4096
+
+/**
+ * Ranges closer than this are fetched with a single read.
+ * On network file systems an extra request costs much more than reading
+ * a few more KB.
+ */
+#define PREFETCH_MAX_GAP (256 * 1024)
+/// Dirty ranges closer than this are written back with a single write
+#define FLUSH_MAX_GAP 4096
+
+struct range {
+  int offset;
+  int len;
+};
+
+struct extent {
+  int offset;
+  int size;     ///< number of bytes requested
+  int len;      ///< number of bytes actually read, less than size at EOF
+  uint8_t *data;
+};
+
+/**
+ * Executable opened for patching.
+ * Reads are served from prefetched extents where possible and writes to
+ * prefetched data are only collected until exefile_flush, so that a whole
+ * command needs only a few large reads and writes.
+ */
+struct exefile {
+#ifdef _WIN32
+  FILE *f;
+#else
+  int fd;
+#endif
+  int num_extents;
+  struct extent *extents;
+  int num_dirty;
+  struct range *dirty;
+  int modified; ///< anything was written
+};
+
+static int raw_read(struct exefile *f, uint8_t *buffer, int offset, int size) {
+  int64_t start = trace_start();
+  int got = 0;
+#ifdef _WIN32
+  COUNT(CNT_SEEKS, 1);
+  COUNT(CNT_READS, 1);
+  if (fseek(f->f, offset, SEEK_SET))
+    return -1;
+  got = fread(buffer, 1, size, f->f);
+#else
+  while (got < size) {
+    ssize_t res = pread(f->fd, buffer + got, size - got, offset + got);
+    COUNT(CNT_READS, 1);
+    if (res < 0 && errno == EINTR)
+      continue;
+    if (res < 0)
+      return -1;
+    if (res == 0)
+      break;
+    got += res;
+  }
+#endif
+  COUNT(CNT_BYTES_READ, got);
+  trace_end("read", start, offset, size);
+  return got;
+}
+
+static int raw_write(struct exefile *f, const uint8_t *buffer, int offset, int size) {
+  int64_t start = trace_start();
+  int done = 0;
+#ifdef _WIN32
+  COUNT(CNT_SEEKS, 1);
+  COUNT(CNT_WRITES, 1);
+  if (fseek(f->f, offset, SEEK_SET))
+    return 0;
+  done = fwrite(buffer, 1, size, f->f);
+#else
+  while (done < size) {
+    ssize_t res = pwrite(f->fd, buffer + done, size - done, offset + done);
+    COUNT(CNT_WRITES, 1);
+    if (res < 0 && errno == EINTR)
+      continue;
+    if (res <= 0)
+      break;
+    done += res;
+  }
+#endif
+  COUNT(CNT_BYTES_WRITTEN, done);
+  trace_end("write", start, offset, size);
+  return done == size;
+}
+
+static struct exefile *exefile_open(const char *name, int writable) {
+  struct exefile *f = (struct exefile *)calloc(1, sizeof(*f));
+#ifdef _WIN32
+  f->f = fopen(name, writable ? "r+b" : "rb");
+  if (!f->f) {
+#else
+  f->fd = open(name, writable ? O_RDWR : O_RDONLY);
+  if (f->fd < 0) {
+#endif
+    int err = errno;
+    free(f);
+    errno = err;
+    return NULL;
+  }
+  return f;
+}
+
+static int cmp_range(const void *a, const void *b) {
+  const struct range *ra = (const struct range *)a;
+  const struct range *rb = (const struct range *)b;
+  return ra->offset - rb->offset;
+}
+
+/**
+ * Write back all collected writes, merging nearby ones.
+ * \return 0 if writing failed
+ */
+static int exefile_flush(struct exefile *f) {
+  int i, j;
+  int res = 1;
+  if (!f->num_dirty)
+    return 1;
+  qsort(f->dirty, f->num_dirty, sizeof(*f->dirty), cmp_range);
+  for (i = 0; i < f->num_dirty; i = j) {
+    const struct extent *e = NULL;
+    int start = f->dirty[i].offset;
+    int end = start + f->dirty[i].len;
+    int k;
+    for (k = 0; k < f->num_extents; k++)
+      if (f->extents[k].offset <= start && start < f->extents[k].offset + f->extents[k].len &&
+          (!e || f->extents[k].offset + f->extents[k].len > e->offset + e->len))
+        e = &f->extents[k];
+    assert(e);
+    // merge while the gap is small and data is still within the same extent
+    for (j = i + 1; j < f->num_dirty; j++) {
+      int next_end = f->dirty[j].offset + f->dirty[j].len;
+      if (f->dirty[j].offset > end + FLUSH_MAX_GAP || next_end > e->offset + e->len)
+        break;
+      if (next_end > end)
+        end = next_end;
+    }
+    if (!raw_write(f, e->data + start - e->offset, start, end - start))
+      res = 0;
+  }
+  f->num_dirty = 0;
+  return res;
+}
+
+/**
+ * Drop all writes that have not been flushed yet, e.g. to abandon a set
+ * of changes that failed half-way.
+ * Prefetched data is dropped as well since it contains those writes.
+ */
+static void exefile_discard(struct exefile *f) {
+  int i;
+  for (i = 0; i < f->num_extents; i++)
+    free(f->extents[i].data);
+  f->num_extents = 0;
+  f->num_dirty = 0;
+}
+
+/**
+ * Closes the file, flushing pending writes.
+ * \return 0 if writing failed
+ */
+static int exefile_close(struct exefile *f) {
+  int res = exefile_flush(f);
+  int i;
+#ifdef _WIN32
+  if (fclose(f->f))
+    res = 0;
+#else
+  if (close(f->fd))
+    res = 0;
+#endif
+  for (i = 0; i < f->num_extents; i++)
+    free(f->extents[i].data);
+  free(f->extents);
+  free(f->dirty);
+  free(f);
+  return res;
+}
+
+static const struct extent *find_extent(const struct exefile *f, int offset, int size) {
+  int i;
+  for (i = 0; i < f->num_extents; i++)
+    if (f->extents[i].offset <= offset &&
+        offset + size <= f->extents[i].offset + f->extents[i].size)
+      return &f->extents[i];
+  return NULL;
+}
+
+/**
+ * Read all given ranges with as few read calls as possible.
+ * The ranges array is sorted in-place.
+ */
+static void exefile_prefetch(struct exefile *f, struct range *ranges, int n) {
+  int i = 0;
+  exefile_flush(f);
+  qsort(ranges, n, sizeof(*ranges), cmp_range);
+  while (i < n) {
+    struct extent e;
+    int end;
+    int res;
+    if (find_extent(f, ranges[i].offset, ranges[i].len)) {
+      i++;
+      continue;
+    }
+    e.offset = ranges[i].offset;
+    end = ranges[i].offset + ranges[i].len;
+    for (i++; i < n && ranges[i].offset <= end + PREFETCH_MAX_GAP; i++)
+      if (ranges[i].offset + ranges[i].len > end)
+        end = ranges[i].offset + ranges[i].len;
+    e.size = end - e.offset;
+    e.data = (uint8_t *)malloc(e.size);
+    res = raw_read(f, e.data, e.offset, e.size);
+    if (res < 0) {
+      // leave it to the uncached path to report errors
+      free(e.data);
+      continue;
+    }
+    e.len = res;
+    f->extents = (struct extent *)realloc(f->extents, (f->num_extents + 1) * sizeof(*f->extents));
+    f->extents[f->num_extents++] = e;
+  }
+}
 
 /**
  * \return 0 if an error occurred while reading or seeking
  */
-static int read_buffer(uint8_t *buffer, FILE *f, int offset, int size) {
+static int read_buffer(uint8_t *buffer, struct exefile *f, int offset, int size) {
+  const struct extent *e = find_extent(f, offset, size);
   assert(size <= BUFFER_SZ);
+  COUNT(CNT_READ_BUFFER, 1);
   memset(buffer, 0, size);
-  if (fseek(f, offset, SEEK_SET))
-    return 0;
-  if (fread(buffer, 1, size, f) != size)
+  if (e) {
+    COUNT(CNT_READ_CACHED, 1);
+    if (offset + size > e->offset + e->len)
+      return 0;
+    memcpy(buffer, e->data + offset - e->offset, size);
+    return 1;
+  }
+  // uncached data might overlap with data not written yet
+  if (!exefile_flush(f))
     return 0;
-  return 1;
+  return raw_read(f, buffer, offset, size) == size;
 }
 
-static int write_buffer(const uint8_t *buffer, FILE *f, int offset, int size) {
+static int write_buffer(const uint8_t *buffer, struct exefile *f, int offset, int size) {
+  int i;
+  const struct extent *e = find_extent(f, offset, size);
   assert(size <= BUFFER_SZ);
-  if (fseek(f, offset, SEEK_SET))
+  COUNT(CNT_WRITE_BUFFER, 1);
+  if (e && offset + size > e->offset + e->len)
     return 0;
-  if (fwrite(buffer, 1, size, f) != size)
+  f->modified = 1;
+  if (!e && (!exefile_flush(f) || !raw_write(f, buffer, offset, size)))
     return 0;
+  // keep all cached copies up-to-date
+  for (i = 0; i < f->num_extents; i++) {
+    struct extent *o = &f->extents[i];
+    int start = offset > o->offset ? offset : o->offset;
+    int end = offset + size < o->offset + o->len ? offset + size : o->offset + o->len;
+    if (start < end)
+      memcpy(o->data + start - o->offset, buffer + start - offset, end - start);
+  }
+  if (e) {
+    f->dirty = (struct range *)realloc(f->dirty, (f->num_dirty + 1) * sizeof(*f->dirty));
+    f->dirty[f->num_dirty].offset = offset;
+    f->dirty[f->num_dirty].len = size;
+    f->num_dirty++;
+  }
   return 1;
 }
 
@@ -197,7 +603,9 @@ enum PATCHES {
   PATCH_SHOWFPS_FPS_SCENESTATS,
   PATCH_SHOWFPS_FPS_TEXSTATS,
 
-  NUM_PATCHES
+  NUM_PATCHES,
+  /// patches loaded from a patch database are numbered from NUM_PATCHES up to this
+  MAX_PATCH = 0x7fff
 } SHORT_ENUM;
 
 // patch groups help ensure that all patching will be reversible
@@ -842,9 +1250,28 @@ static const struct metapatch {
   {NULL}
 };
 
-static int check_patch(uint8_t *buffer, FILE *f, enum PATCHES patch, int silent) {
-  const struct patchdesc *p = &patchdescs[patch];
+/**
+ * Patch database (see --db) currently mapped, only the index and the
+ * entries of the matched binary are ever read from it.
+ */
+static const uint8_t *patchdb;
+
+/// patches of the binary matched in the patch database, numbered from NUM_PATCHES on
+static struct patchdesc *ext_patchdescs;
+static const char **ext_patchnames;
+
+static const struct patchdesc *get_patchdesc(enum PATCHES patch) {
+  return patch < NUM_PATCHES ? &patchdescs[patch] : &ext_patchdescs[patch - NUM_PATCHES];
+}
+
+static const char *get_patchname(enum PATCHES patch) {
+  return patch < NUM_PATCHES ? patchnames[patch] : ext_patchnames[patch - NUM_PATCHES];
+}
+
+static int check_patch(uint8_t *buffer, struct exefile *f, enum PATCHES patch, int silent) {
+  const struct patchdesc *p = get_patchdesc(patch);
   int match;
+  COUNT(CNT_CHECK_PATCH, 1);
   if (DEBUG) printf("Checking for patch %i\n", patch);
   if (!read_buffer(buffer, f, p->offset, p->len)) {
     if (!silent)
@@ -860,15 +1287,18 @@ static int check_patch(uint8_t *buffer, FILE *f, enum PATCHES patch, int silent)
   return match;
 }
 
-static int count_patches(uint8_t *buffer, FILE *f, const enum PATCHES *patchgroups) {
+static int count_patches(uint8_t *buffer, struct exefile *f, const enum PATCHES *patchgroups) {
+  int64_t start = trace_start();
   int i = 0;
   int count = 0;
+  COUNT(CNT_COUNT_PATCHES, 1);
   while (patchgroups[i] != NO_PATCH) {
     for (; patchgroups[i] != NO_PATCH; i++)
       if (check_patch(buffer, f, patchgroups[i], 1))
         count++;
     i++;
   }
+  trace_end("count_patches", start, -1, -1);
   return count;
 }
 
@@ -891,8 +1321,8 @@ static void list_patches(const enum PATCHES *patchgroups) {
     printf("Patch group %i:\n", group);
     for (; patchgroups[i] != NO_PATCH; i++) {
       enum PATCHES p = patchgroups[i];
-      const char *comment = patchdescs[p].original ? " (unmodified original)" : "";
-      printf("%4i : %s%s\n", p, patchnames[p], comment);
+      const char *comment = get_patchdesc(p)->original ? " (unmodified original)" : "";
+      printf("%4i : %s%s\n", p, get_patchname(p), comment);
     }
     printf("\n");
     i++;
@@ -939,12 +1369,20 @@ static const enum PATCHES *find_patchgroup(const enum PATCHES *patchgroups, enum
   return NULL;
 }
 
-static int apply_patch(uint8_t *buffer, FILE *f, const enum PATCHES *patchgroups, enum PATCHES patch) {
-  const struct patchdesc *p = &patchdescs[patch];
+static int apply_patch(uint8_t *buffer, struct exefile *f, const enum PATCHES *patchgroups, enum PATCHES patch) {
+  const struct patchdesc *p = get_patchdesc(patch);
   enum PATCHES previous = NO_PATCH;
+  int64_t start = trace_start();
   int i;
   const enum PATCHES *group = find_patchgroup(patchgroups, patch);
   assert(group);
+  COUNT(CNT_APPLY_PATCH, 1);
+  // avoid pointless writes, they would e.g. wake up --watch again
+  if (check_patch(buffer, f, patch, 1)) {
+    printf("Patch %i already applied\n", patch);
+    trace_end("apply_patch", start, p->offset, p->len);
+    return 1;
+  }
   for (i = 0; group[i] != NO_PATCH; i++) {
     if (check_patch(buffer, f, group[i], 0)) {
       previous = group[i];
@@ -960,14 +1398,16 @@ static int apply_patch(uint8_t *buffer, FILE *f, const enum PATCHES *patchgroups
     goto fail;
   }
   printf("Patched from %i to %i\n", previous, patch);
+  trace_end("apply_patch", start, p->offset, p->len);
   return 1;
 
 fail:
   printf("Failed to apply patch %i\n", patch);
+  trace_end("apply_patch", start, p->offset, p->len);
   return 0;
 }
 
-static int apply_collection(uint8_t *buffer, FILE *f, const struct binary *binary, int c) {
+static int apply_collection(uint8_t *buffer, struct exefile *f, const struct binary *binary, int c) {
   int i;
   const struct collection *collections = binary->collections;
   for (i = 0; collections[c].patches[i] != NO_PATCH; i++) {
@@ -977,7 +1417,7 @@ static int apply_collection(uint8_t *buffer, FILE *f, const struct binary *binar
   return 1;
 }
 
-static int apply_metapatch(uint8_t *buffer, FILE *f, const struct binary *binary, int m) {
+static int apply_metapatch(uint8_t *buffer, struct exefile *f, const struct binary *binary, int m) {
   int i;
   int applied = 0;
   int valid = 0;
@@ -992,29 +1432,145 @@ static int apply_metapatch(uint8_t *buffer, FILE *f, const struct binary *binary
   return valid && applied == valid;
 }
 
-static const int max_fps_offset = 0x13d402;
-static const int max_fps_idx[] = {0x13d403 - 0x13d402, 0x13d418 - 0x13d402};
-static int get_max_fps(uint8_t *buffer, FILE *f) {
-  if (!read_buffer(buffer, f, max_fps_offset, max_fps_idx[1] + 1))
-    return -1;
-  if (buffer[max_fps_idx[0] - 1] != 0x6a ||
-      buffer[max_fps_idx[1] - 1] != 0x6a)
+/**
+ * Check with which binary description we get the most patch matches.
+ * \param count set to the number of matching patch groups
+ * \return index into binaries, 0 if nothing matched at all
+ */
+static int detect_binary(uint8_t *buffer, struct exefile *f, int *count) {
+  int i;
+  int best_pos = 0;
+  *count = 0;
+  for (i = 0; binaries[i].name; i++) {
+    int c = count_patches(buffer, f, binaries[i].patchgroups);
+    if (c > *count) {
+      *count = c;
+      best_pos = i;
+    }
+  }
+  return best_pos;
+}
+
+enum PARAM_TYPE {
+  PARAM_U8,
+  PARAM_U32,
+  PARAM_F32,
+} SHORT_ENUM;
+
+/*
+ * Parameters are immediate values of instructions, PARAMS_PER_RES
+ * consecutive entries per resolution, in resdes order.
+ */
+enum PARAMS {
+  PARAM_RES_W = 0,
+  PARAM_RES_H,
+  PARAM_RES_HUD_SCALE,
+  PARAM_RES_FOV,
+  PARAMS_PER_RES,
+  PARAM_MAX_FPS_1 = NUM_RES * PARAMS_PER_RES,
+  PARAM_MAX_FPS_2,
+  NUM_PARAMS
+} SHORT_ENUM;
+
+static const struct paramdesc {
+  int offset;            ///< file offset of the instruction
+  int len;               ///< number of opcode bytes before the immediate
+  const uint8_t *opcode;
+  enum PARAM_TYPE type;  ///< type of the immediate following the opcode
+  uint32_t original;     ///< value in the unmodified binary, raw bits for floats
+  const char *name;
+} paramdescs[NUM_PARAMS] = {
+#define MOV_EAX (const uint8_t [1]){0xb8}
+#define MOV_ECX (const uint8_t [1]){0xb9}
+#define MOV_HUD (const uint8_t [6]){0xc7, 0x05, 0xb8, 0x02, 0x60, 0x00}
+#define MOV_FOV (const uint8_t [6]){0xc7, 0x05, 0x6c, 0xab, 0x91, 0x00}
+#define PUSH    (const uint8_t [1]){0x6a}
+  {0x10a3dd, 1, MOV_EAX, PARAM_U32,  640, "640x480 width"},
+  {0x10a3e2, 1, MOV_ECX, PARAM_U32,  480, "640x480 height"},
+  {0x10f422, 6, MOV_HUD, PARAM_F32, 0x3f800000, "640x480 HUD scale"},
+  {0x10f42c, 6, MOV_FOV, PARAM_U32,  512, "640x480 FOV"},
+  {0x10a334, 1, MOV_EAX, PARAM_U32,  800, "800x600 width"},
+  {0x10a339, 1, MOV_ECX, PARAM_U32,  600, "800x600 height"},
+  {0x10f44f, 6, MOV_HUD, PARAM_F32, 0x3f800000, "800x600 HUD scale"},
+  {0x10f459, 6, MOV_FOV, PARAM_U32,  640, "800x600 FOV"},
+  {0x10a37c, 1, MOV_EAX, PARAM_U32, 1152, "1152x864 width"},
+  {0x10a381, 1, MOV_ECX, PARAM_U32,  864, "1152x864 height"},
+  {0x10f4a6, 6, MOV_HUD, PARAM_F32, 0x3fb851ec, "1152x864 HUD scale"},
+  {0x10f4b0, 6, MOV_FOV, PARAM_U32,  922, "1152x864 FOV"},
+  {0x10a3bb, 1, MOV_EAX, PARAM_U32, 1600, "1600x1200 width"},
+  {0x10a3c0, 1, MOV_ECX, PARAM_U32, 1200, "1600x1200 height"},
+  {0x10f4fa, 6, MOV_HUD, PARAM_F32, 0x40000000, "1600x1200 HUD scale"},
+  {0x10f504, 6, MOV_FOV, PARAM_U32, 1280, "1600x1200 FOV"},
+  [PARAM_MAX_FPS_1] = {0x13d402, 1, PUSH, PARAM_U8, 24, "max FPS limit part 1"},
+  [PARAM_MAX_FPS_2] = {0x13d417, 1, PUSH, PARAM_U8, 24, "max FPS limit part 2"},
+#undef MOV_EAX
+#undef MOV_ECX
+#undef MOV_HUD
+#undef MOV_FOV
+#undef PUSH
+};
+
+static int param_size(enum PARAM_TYPE type) {
+  return type == PARAM_U8 ? 1 : 4;
+}
+
+/**
+ * \return 0 if the instruction does not match or could not be read
+ */
+static int read_param(uint8_t *buffer, struct exefile *f, enum PARAMS param, uint32_t *value) {
+  const struct paramdesc *p = &paramdescs[param];
+  int size = param_size(p->type);
+  if (!read_buffer(buffer, f, p->offset, p->len + size) ||
+      memcmp(buffer, p->opcode, p->len))
+    return 0;
+  *value = size == 1 ? buffer[p->len] : RL32(buffer + p->len);
+  return 1;
+}
+
+/**
+ * Read all parameters in one pass.
+ * \param valid set to 0 for parameters that could not be read
+ */
+static void read_params(uint8_t *buffer, struct exefile *f, uint32_t values[NUM_PARAMS], int valid[NUM_PARAMS]) {
+  int i;
+  for (i = 0; i < NUM_PARAMS; i++)
+    valid[i] = read_param(buffer, f, (enum PARAMS)i, &values[i]);
+}
+
+/**
+ * Change the immediate of a parameter, only the value is written.
+ * Use read_param to check the instruction first.
+ * \return 0 on error
+ */
+static int write_param(uint8_t *buffer, struct exefile *f, enum PARAMS param, uint32_t value) {
+  const struct paramdesc *p = &paramdescs[param];
+  int size = param_size(p->type);
+  if (size == 1 && value > 255)
+    return 0;
+  if (size == 1)
+    buffer[0] = value;
+  else
+    WL32(buffer, value);
+  return write_buffer(buffer, f, p->offset + p->len, size);
+}
+
+static int get_max_fps(uint8_t *buffer, struct exefile *f) {
+  uint32_t fps[2];
+  if (!read_param(buffer, f, PARAM_MAX_FPS_1, &fps[0]) ||
+      !read_param(buffer, f, PARAM_MAX_FPS_2, &fps[1]))
     return -1;
-  if (buffer[max_fps_idx[0]] != buffer[max_fps_idx[1]])
+  if (fps[0] != fps[1])
     return -1;
-  return buffer[max_fps_idx[0]];
+  return fps[0];
 }
 
-static int set_max_fps(uint8_t *buffer, FILE *f, int fps) {
+static int set_max_fps(uint8_t *buffer, struct exefile *f, int fps) {
   if (get_max_fps(buffer, f) < 0)
     return 0;
   if (fps < 0 || fps > 255)
     return 0;
-  buffer[max_fps_idx[0]] = fps;
-  buffer[max_fps_idx[1]] = fps;
-  if (!write_buffer(buffer, f, max_fps_offset, max_fps_idx[1] + 1))
-    return 0;
-  return 1;
+  return write_param(buffer, f, PARAM_MAX_FPS_1, fps) &&
+         write_param(buffer, f, PARAM_MAX_FPS_2, fps);
 }
 
 struct resopts {
@@ -1048,47 +1604,82 @@ static int deg2fov(float deg, int height) {
   return fov > 0 ? fov : 1;
 }
 
-static void read_res(uint8_t *buffer, FILE *f, struct resopts res[NUM_RES]) {
+static void read_res(uint8_t *buffer, struct exefile *f, struct resopts res[NUM_RES]) {
+  int64_t start = trace_start();
+  uint32_t values[NUM_PARAMS];
+  int valid[NUM_PARAMS];
   int i;
+  COUNT(CNT_RESOLUTION, 1);
+  read_params(buffer, f, values, valid);
   for (i = 0; i < NUM_RES; i++) {
-    res[i].w = res[i].h = res[i].fov = -1;
-    res[i].hud_scale.i = 0xffffffffu;
-    if (read_buffer(buffer, f, resdes[i].offset, 10)) {
-      if (buffer[0] == 0xb8) res[i].w = RL32(buffer + 1);
-      if (buffer[5] == 0xb9) res[i].h = RL32(buffer + 6);
-    }
-    if (read_buffer(buffer, f, resdes[i].fov_offset, 20)) {
-      static const uint8_t instr[2][6] = {
-        {0xc7, 0x05, 0xb8, 0x02, 0x60, 0x00},
-        {0xc7, 0x05, 0x6c, 0xab, 0x91, 0x00}
-      };
-      if (memcmp(buffer, instr[0], 6) == 0)
-        res[i].hud_scale.i = RL32(buffer + 6);
-      if (memcmp(buffer + 10, instr[1], 6) == 0)
-        res[i].fov = RL32(buffer + 16);
-    }
+    const uint32_t *v = values + i * PARAMS_PER_RES;
+    const int *ok = valid + i * PARAMS_PER_RES;
+    res[i].w = ok[PARAM_RES_W] ? (int)v[PARAM_RES_W] : -1;
+    res[i].h = ok[PARAM_RES_H] ? (int)v[PARAM_RES_H] : -1;
+    res[i].hud_scale.i = ok[PARAM_RES_HUD_SCALE] ? v[PARAM_RES_HUD_SCALE] : 0xffffffffu;
+    res[i].fov = ok[PARAM_RES_FOV] ? (int)v[PARAM_RES_FOV] : -1;
   }
+  trace_end("read_res", start, -1, -1);
 }
 
-static int write_res(uint8_t *buffer, FILE *f, const struct resopts *newval, int num,
+static int write_res(uint8_t *buffer, struct exefile *f, const struct resopts *newval, int num,
                      int skip_hud_scale, int skip_deg) {
-  buffer[0] = 0xb8; buffer[5] = 0xb9;
-  WL32(buffer + 1, newval->w); WL32(buffer + 6, newval->h);
-  if (!write_buffer(buffer, f, resdes[num].offset, 10)) {
-    printf("Error writing new resolutions to file\n");
-    return 0;
+  enum PARAMS first = (enum PARAMS)(num * PARAMS_PER_RES);
+  uint32_t values[PARAMS_PER_RES];
+  int i;
+  COUNT(CNT_RESOLUTION, 1);
+  values[PARAM_RES_W] = newval->w;
+  values[PARAM_RES_H] = newval->h;
+  values[PARAM_RES_HUD_SCALE] = newval->hud_scale.i;
+  values[PARAM_RES_FOV] = newval->fov;
+  // validate everything first so we never write only part of it
+  for (i = 0; i < PARAMS_PER_RES; i++) {
+    uint32_t old;
+    if ((i == PARAM_RES_HUD_SCALE && skip_hud_scale) || (i == PARAM_RES_FOV && skip_deg))
+      continue;
+    if (!read_param(buffer, f, (enum PARAMS)(first + i), &old)) {
+      printf("Could not find %s in file\n", paramdescs[first + i].name);
+      return 0;
+    }
   }
-  WL32(buffer, newval->hud_scale.i);
-  WL32(buffer + 4, newval->fov);
-  if ((!skip_hud_scale && !write_buffer(buffer, f, resdes[num].fov_offset + 6, 4)) ||
-      (!skip_deg && !write_buffer(buffer + 4, f, resdes[num].fov_offset + 16, 4))) {
-    printf("Error fixing up fov/HUD scale\n");
-    return 0;
+  for (i = 0; i < PARAMS_PER_RES; i++) {
+    if ((i == PARAM_RES_HUD_SCALE && skip_hud_scale) || (i == PARAM_RES_FOV && skip_deg))
+      continue;
+    if (!write_param(buffer, f, (enum PARAMS)(first + i), values[i])) {
+      printf("Error writing new resolutions to file\n");
+      return 0;
+    }
   }
   return 1;
 }
 
-#ifndef GUI
+/**
+ * Prefetch everything that detection and any of the commands might need.
+ */
+static void prefetch_all(struct exefile *f) {
+  struct range ranges[NUM_PATCHES + NUM_PARAMS + 1];
+  int n = 0;
+  int i;
+  // the start of the file identifies it in the patch database
+  if (patchdb) {
+    ranges[n].offset = 0;
+    ranges[n].len = FINGERPRINT_LEN;
+    n++;
+  }
+  for (i = FIRST_PATCH; i < NUM_PATCHES; i++) {
+    ranges[n].offset = patchdescs[i].offset;
+    ranges[n].len = patchdescs[i].len;
+    n++;
+  }
+  for (i = 0; i < NUM_PARAMS; i++) {
+    ranges[n].offset = paramdescs[i].offset;
+    ranges[n].len = paramdescs[i].len + param_size(paramdescs[i].type);
+    n++;
+  }
+  exefile_prefetch(f, ranges, n);
+}
+
+#if !defined(GUI) && !defined(NO_MAIN)
 static const char optionhelp[] =
   "Options:\n"
   "  -l             : List available patches\n"
@@ -1104,11 +1695,23 @@ static const char optionhelp[] =
   "                   and the vertical field of view (f)\n"
   "  -f             : Show current max FPS limit (XWA only)\n"
   "  -f <f>         : Set max FPS limit to <f> (XWA only)\n"
+  "  -v             : List raw parameter values (XWA only)\n"
+  "  -v <n> <v>     : Set raw parameter <n> to value <v> (XWA only)\n"
+  "  -e <file.ips>  : Export changes against the unmodified original as IPS delta\n"
+  "  -i <file.ips>  : Apply an IPS delta, only if it matches the known patches\n"
 ;
 
 static void print_help(const char *prog) {
-  printf("Usage: %s xwingalliance.exe [option]\n", prog);
+  printf("Usage: %s [--stats] [--trace <file.json>] [--db <patches.db>] xwingalliance.exe [option]\n", prog);
+  printf("       %s [--db <patches.db>] --watch <watchlist>\n", prog);
+  printf("       %s [--db <patches.db>] --fleet [--jobs <n>] [--per-host <n>] [--bw <MB/s>] [--iops <n>] [--journal <file>]\n"
+         "           <patch|verify|inventory> <filelist>\n", prog);
+  printf("       %s [--db <patches.db>] --fingerprint <file.exe>\n", prog);
+  printf("       %s --db-compile <patches.txt> <patches.db>\n", prog);
   printf(optionhelp);
+  printf("  --stats        : Print I/O statistics and phase timings when done\n"
+         "  --trace <file> : Write I/O and phase timeline in Chrome trace format\n"
+         "  --db <file>    : Also detect binaries described in a patch database\n");
 }
 
 static int parse_num(const char *s, int limit) {
@@ -1127,61 +1730,1987 @@ static float parse_float(const char *s, float min, float max) {
   return num;
 }
 
-int main(int argc, char *argv[]) {
-  int binary_best_pos = 0;
-  int binary_best_count = 0;
-  struct resopts resolutions[NUM_RES];
-  int detected_patches[NUM_PATCHES];
-  uint8_t buffer[BUFFER_SZ];
-  FILE *xwa = 0;
-  int is_xwa;
-  int i;
-  int res = 1;
-  enum PATCHES p;
-  const struct binary *binary;
-  const char *prog = argc > 0 ? argv[0] : "xwahacker";
+/*
+ * Patch database, compiled by --db-compile from a text description.
+ * All values are little-endian:
+ * header:  "XWAPDB1\0", u32 database version, u32 number of binaries
+ * index:   per binary u32 file size, u32 fingerprint CRC, u32 record offset,
+ *          sorted by size and CRC
+ * record:  u32 name offset, u32 file name offset, u32 number of patches
+ *          followed by the patches:
+ *          u32 offset in binary, u32 value offset, u32 name offset,
+ *          u16 length, u8 unmodified original, u8 last patch in group
+ * The strings and patch values follow the records.
+ */
+#define PATCHDB_HEADER_SIZE 16
+#define PATCHDB_INDEX_SIZE 12
+#define PATCHDB_RECORD_SIZE 12
+#define PATCHDB_PATCH_SIZE 16
+
+static const char patchdb_magic[8] = "XWAPDB1";
+static size_t patchdb_size;
+static uint32_t patchdb_version;
+static uint32_t patchdb_num;
+
+static int ext_num_patches;
+static enum PATCHES *ext_patchgroups;
+static struct binary ext_binary;
+
+static void *map_file(const char *fname, size_t *size) {
+  void *map = NULL;
+#ifdef _WIN32
+  HANDLE mapping = NULL;
+  HANDLE file = CreateFileA(fname, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+  if (file == INVALID_HANDLE_VALUE)
+    return NULL;
+  *size = GetFileSize(file, NULL);
+  if (*size != INVALID_FILE_SIZE && *size > 0)
+    mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+  if (mapping)
+    map = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+  // the view keeps the file open
+  if (mapping)
+    CloseHandle(mapping);
+  CloseHandle(file);
+#else
+  struct stat statbuf;
+  int fd = open(fname, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+  if (!fstat(fd, &statbuf) && statbuf.st_size > 0) {
+    *size = statbuf.st_size;
+    map = mmap(NULL, *size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+      map = NULL;
+  }
+  close(fd);
+#endif
+  return map;
+}
 
-  if (argc < 2) {
-    print_help(prog);
-    return 1;
+static void unmap_file(void *map, size_t size) {
+#ifdef _WIN32
+  UnmapViewOfFile(map);
+#else
+  munmap(map, size);
+#endif
+}
+
+/**
+ * Map a patch database, only its header is read here.
+ * \return 0 on failure
+ */
+static int patchdb_open(const char *fname) {
+  uint8_t *map = (uint8_t *)map_file(fname, &patchdb_size);
+  if (!map) {
+    printf("Could not open patch database %s\n", fname);
+    return 0;
   }
+  if (patchdb_size < PATCHDB_HEADER_SIZE || memcmp(map, patchdb_magic, sizeof(patchdb_magic)) ||
+      RL32(map + 12) > (patchdb_size - PATCHDB_HEADER_SIZE) / PATCHDB_INDEX_SIZE) {
+    printf("%s is not a valid patch database\n", fname);
+    unmap_file(map, patchdb_size);
+    return 0;
+  }
+  patchdb = map;
+  patchdb_version = RL32(patchdb + 8);
+  patchdb_num = RL32(patchdb + 12);
+  return 1;
+}
 
-  xwa = fopen(argv[1], "r+b");
-  if (!xwa) {
-    printf("Could not open file %s: %s\n", argv[1], strerror(errno));
-    return 1;
+/**
+ * Binary search in the patch database index.
+ * \return record offset, 0 if the fingerprint is not in the database
+ */
+static uint32_t patchdb_find(uint32_t size, uint32_t crc) {
+  uint32_t lo = 0;
+  uint32_t hi = patchdb_num;
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    const uint8_t *e = patchdb + PATCHDB_HEADER_SIZE + mid * PATCHDB_INDEX_SIZE;
+    uint32_t s = RL32(e);
+    uint32_t c = RL32(e + 4);
+    if (s == size && c == crc)
+      return RL32(e + 8);
+    if (s < size || (s == size && c < crc))
+      lo = mid + 1;
+    else
+      hi = mid;
   }
+  return 0;
+}
 
-  // check with which binary description we get the most patch matches
-  for (i = 0; binaries[i].name; i++) {
-    int count = count_patches(buffer, xwa, binaries[i].patchgroups);
-    if (count > binary_best_count) {
-      binary_best_count = count;
-      binary_best_pos   = i;
-    }
+/// \return string at offset in the patch database, NULL if it is not terminated
+static const char *patchdb_string(uint32_t offset) {
+  if (offset >= patchdb_size || !memchr(patchdb + offset, 0, patchdb_size - offset))
+    return NULL;
+  return (const char *)patchdb + offset;
+}
+
+/**
+ * Make the patches of one patch database record available as ext_binary.
+ * \return 0 if the record is invalid
+ */
+static int patchdb_load(uint32_t record) {
+  const uint8_t *r;
+  uint32_t num;
+  uint32_t i;
+  int g = 0;
+  ext_num_patches = 0;
+  if (record > patchdb_size - PATCHDB_RECORD_SIZE)
+    return 0;
+  r = patchdb + record;
+  num = RL32(r + 8);
+  if (num == 0 || num > MAX_PATCH - NUM_PATCHES ||
+      num > (patchdb_size - record - PATCHDB_RECORD_SIZE) / PATCHDB_PATCH_SIZE)
+    return 0;
+  ext_binary.name = patchdb_string(RL32(r));
+  ext_binary.filename = patchdb_string(RL32(r + 4));
+  if (!ext_binary.name || !ext_binary.filename)
+    return 0;
+  ext_patchdescs = (struct patchdesc *)realloc(ext_patchdescs, num * sizeof(*ext_patchdescs));
+  ext_patchnames = (const char **)realloc(ext_patchnames, num * sizeof(*ext_patchnames));
+  ext_patchgroups = (enum PATCHES *)realloc(ext_patchgroups, (2 * num + 1) * sizeof(*ext_patchgroups));
+  for (i = 0; i < num; i++) {
+    const uint8_t *e = r + PATCHDB_RECORD_SIZE + i * PATCHDB_PATCH_SIZE;
+    struct patchdesc *d = &ext_patchdescs[i];
+    uint32_t offset = RL32(e);
+    uint32_t value = RL32(e + 4);
+    d->len = e[12] | e[13] << 8;
+    d->original = e[14];
+    if (d->len == 0 || d->len > BUFFER_SZ || offset > 0x7fffffff - BUFFER_SZ ||
+        value > patchdb_size || d->len > patchdb_size - value)
+      return 0;
+    d->offset = offset;
+    d->value = patchdb + value;
+    ext_patchnames[i] = patchdb_string(RL32(e + 8));
+    if (!ext_patchnames[i])
+      return 0;
+    ext_patchgroups[g++] = (enum PATCHES)(NUM_PATCHES + i);
+    if (e[15] || i == num - 1)
+      ext_patchgroups[g++] = NO_PATCH;
   }
-  binary = &binaries[binary_best_pos];
-  if (binary_best_count > 0)
-    printf("Detected file as %s with %i matches (of %i)\n",
-           binary->name, binary_best_count, num_patchgroups(binary->patchgroups));
-  else
-    printf("Could not detect file, assuming it is %s\n", binary->name);
-  rewind(xwa);
-  is_xwa = binary_best_pos == 0;
+  ext_patchgroups[g] = NO_PATCH;
+  ext_binary.patchgroups = ext_patchgroups;
+  ext_binary.collections = NULL;
+  ext_num_patches = num;
+  return 1;
+}
 
-  read_res(buffer, xwa, resolutions);
+static int64_t file_size(struct exefile *f) {
+#ifdef _WIN32
+  if (fseek(f->f, 0, SEEK_END))
+    return -1;
+  return ftell(f->f);
+#else
+  struct stat statbuf;
+  if (fstat(f->fd, &statbuf))
+    return -1;
+  return statbuf.st_size;
+#endif
+}
 
-  if (argc >= 3) {
-    const char *opt = argv[2];
-    if (argc == 3 && strcmp(opt, "-l") == 0) {
-      list_patches(binary->patchgroups);
-      res = 0;
-      goto cleanup;
-    } else if (argc == 3 && strcmp(opt, "-c") == 0 && binary->collections) {
-      list_collections(binary->collections);
-      res = 0;
-      goto cleanup;
-    } else if (argc == 3 && strcmp(opt, "-m") == 0) {
+static uint32_t update_crc(uint32_t crc, const uint8_t *data, int len) {
+  int i, j;
+  for (i = 0; i < len; i++) {
+    crc ^= data[i];
+    for (j = 0; j < 8; j++)
+      crc = crc >> 1 ^ (0xedb88320 & -(crc & 1));
+  }
+  return crc;
+}
+
+/**
+ * Identify a file by its size and a CRC of its first FINGERPRINT_LEN bytes,
+ * i.e. the headers that no patch touches.
+ * \return 0 on failure
+ */
+static int fingerprint(uint8_t *buffer, struct exefile *f, uint32_t *size, uint32_t *crc) {
+  int64_t s = file_size(f);
+  int offset;
+  if (s < 0 || s > 0xffffffffu)
+    return 0;
+  *size = s;
+  *crc = 0xffffffff;
+  for (offset = 0; offset < FINGERPRINT_LEN && offset < s; offset += BUFFER_SZ) {
+    int len = s - offset < BUFFER_SZ ? s - offset : BUFFER_SZ;
+    if (!read_buffer(buffer, f, offset, len))
+      return 0;
+    *crc = update_crc(*crc, buffer, len);
+  }
+  *crc = ~*crc;
+  return 1;
+}
+
+static void prefetch_ext(struct exefile *f) {
+  struct range *ranges = (struct range *)malloc(ext_num_patches * sizeof(*ranges));
+  int i;
+  for (i = 0; i < ext_num_patches; i++) {
+    ranges[i].offset = ext_patchdescs[i].offset;
+    ranges[i].len = ext_patchdescs[i].len;
+  }
+  exefile_prefetch(f, ranges, ext_num_patches);
+  free(ranges);
+}
+
+/**
+ * Like detect_binary, but an exact fingerprint match in the patch database
+ * takes precedence over the built-in binary descriptions.
+ * \param count set to the number of matching patch groups
+ * \return binary description, binaries[0] if nothing matched at all
+ */
+static const struct binary *detect_file(uint8_t *buffer, struct exefile *f, int *count) {
+  uint32_t size, crc, record;
+  if (patchdb && fingerprint(buffer, f, &size, &crc) &&
+      (record = patchdb_find(size, crc)) && patchdb_load(record)) {
+    prefetch_ext(f);
+    *count = count_patches(buffer, f, ext_patchgroups);
+    if (*count > 0)
+      return &ext_binary;
+  }
+  ext_num_patches = 0;
+  return &binaries[detect_binary(buffer, f, count)];
+}
+
+static int print_fingerprint(const char *name) {
+  uint8_t buffer[BUFFER_SZ];
+  const struct binary *binary;
+  const char *base = strrchr(name, '/');
+  uint32_t size, crc;
+  int count;
+  struct exefile *f = exefile_open(name, 0);
+  if (!f) {
+    printf("Could not open file %s: %s\n", name, strerror(errno));
+    return 1;
+  }
+  base = base ? base + 1 : name;
+  prefetch_all(f);
+  binary = detect_file(buffer, f, &count);
+  if (!fingerprint(buffer, f, &size, &crc)) {
+    printf("Could not read file %s\n", name);
+    exefile_close(f);
+    return 1;
+  }
+  printf("binary %u %08x %s %s\n", size, crc, base, count > 0 ? binary->name : base);
+  exefile_close(f);
+  return 0;
+}
+
+struct dbpatch {
+  uint32_t offset;
+  int len;
+  int original;
+  int last;
+  uint8_t *value;
+  char *name;
+};
+
+struct dbbinary {
+  uint32_t size;
+  uint32_t crc;
+  char *filename;
+  char *name;
+  int num;
+  struct dbpatch *patches;
+};
+
+static int cmp_dbbinary(const void *a, const void *b) {
+  const struct dbbinary *x = (const struct dbbinary *)a;
+  const struct dbbinary *y = (const struct dbbinary *)b;
+  if (x->size != y->size)
+    return x->size < y->size ? -1 : 1;
+  if (x->crc != y->crc)
+    return x->crc < y->crc ? -1 : 1;
+  return 0;
+}
+
+/// \return number of bytes, -1 if hex is not a valid hex string
+static int parse_hex(uint8_t *out, const char *hex) {
+  int len = strlen(hex);
+  int i;
+  if (len & 1)
+    return -1;
+  for (i = 0; i < len / 2; i++) {
+    unsigned v;
+    if (!strchr("0123456789abcdefABCDEF", hex[2 * i]) || !strchr("0123456789abcdefABCDEF", hex[2 * i + 1]) ||
+        sscanf(hex + 2 * i, "%2x", &v) != 1)
+      return -1;
+    out[i] = v;
+  }
+  return len / 2;
+}
+
+/// \return offset after the string
+static uint32_t add_string(uint8_t *out, uint32_t offset, const char *s) {
+  int len = strlen(s) + 1;
+  memcpy(out + offset, s, len);
+  return offset + len;
+}
+
+static char *rest_of_line(char *s) {
+  int len = strlen(s);
+  while (len > 0 && strchr(" \t\r\n", s[len - 1]))
+    len--;
+  s[len] = 0;
+  return s;
+}
+
+/**
+ * Compile a text patch description into a patch database.
+ * The description contains lines of the form
+ * version <number>
+ * binary <file size> <fingerprint CRC> <file name> <description>
+ * patch <hex offset> <1 if unmodified original, else 0> <hex bytes> <description>
+ * group
+ * where "group" separates the patch groups of a binary and the
+ * binary lines come from --fingerprint.
+ * \return 0 on success
+ */
+static int compile_patchdb(const char *src, const char *dst) {
+  char line[4096];
+  uint8_t value[BUFFER_SZ];
+  struct dbbinary *bins = NULL;
+  struct dbbinary *b = NULL;
+  uint32_t version = 0;
+  uint32_t pos, pool, size;
+  int num_bins = 0;
+  int total = 0;
+  int lineno = 0;
+  int res = 1;
+  int i, j;
+  uint8_t *out = NULL;
+  FILE *f = fopen(src, "r");
+  if (!f) {
+    printf("Could not open %s: %s\n", src, strerror(errno));
+    return 1;
+  }
+  while (fgets(line, sizeof(line), f)) {
+    char str[2 * BUFFER_SZ + 1];
+    char *rest = line + strspn(line, " \t");
+    unsigned offset, fsize, crc;
+    int original, len, n = 0;
+    lineno++;
+    if (!*rest_of_line(rest) || rest[0] == '#')
+      continue;
+    if (sscanf(rest, "version %u%n", &version, &n) == 1 && !rest[n]) {
+      continue;
+    } else if (sscanf(rest, "binary %u %x %255s %n", &fsize, &crc, str, &n) == 3 && n && rest[n]) {
+      if (b && !b->num)
+        break;
+      bins = (struct dbbinary *)realloc(bins, (num_bins + 1) * sizeof(*bins));
+      b = &bins[num_bins++];
+      memset(b, 0, sizeof(*b));
+      b->size = fsize;
+      b->crc = crc;
+      b->filename = strdup(str);
+      b->name = strdup(rest + n);
+      continue;
+    } else if (strcmp(rest, "group") == 0 && b) {
+      if (b->num)
+        b->patches[b->num - 1].last = 1;
+      continue;
+    } else if (sscanf(rest, "patch %x %d %2048s %n", &offset, &original, str, &n) == 3 && n && rest[n] && b &&
+               (len = parse_hex(value, str)) > 0 && offset >= FINGERPRINT_LEN && offset <= 0x7fffffff - BUFFER_SZ &&
+               b->num < MAX_PATCH - NUM_PATCHES) {
+      struct dbpatch *p;
+      b->patches = (struct dbpatch *)realloc(b->patches, (b->num + 1) * sizeof(*b->patches));
+      p = &b->patches[b->num++];
+      p->offset = offset;
+      p->len = len;
+      p->original = !!original;
+      p->last = 0;
+      p->value = (uint8_t *)malloc(len);
+      memcpy(p->value, value, len);
+      p->name = strdup(rest + n);
+      total++;
+      continue;
+    }
+    break;
+  }
+  if (!feof(f) || ferror(f)) {
+    printf("%s:%i: invalid line\n", src, lineno);
+    goto cleanup;
+  }
+  if (!num_bins || !b->num) {
+    printf("%s: every binary needs at least one patch\n", src);
+    goto cleanup;
+  }
+
+  qsort(bins, num_bins, sizeof(*bins), cmp_dbbinary);
+  pos = PATCHDB_HEADER_SIZE + num_bins * PATCHDB_INDEX_SIZE;
+  size = 0;
+  for (i = 0; i < num_bins; i++) {
+    if (i && cmp_dbbinary(&bins[i - 1], &bins[i]) == 0) {
+      printf("%s: %s and %s have the same fingerprint\n", src, bins[i - 1].name, bins[i].name);
+      goto cleanup;
+    }
+    bins[i].patches[bins[i].num - 1].last = 1;
+    pos += PATCHDB_RECORD_SIZE + bins[i].num * PATCHDB_PATCH_SIZE;
+    size += strlen(bins[i].name) + strlen(bins[i].filename) + 2;
+    for (j = 0; j < bins[i].num; j++)
+      size += bins[i].patches[j].len + strlen(bins[i].patches[j].name) + 1;
+  }
+  // strings and values are stored after all records
+  pool = pos;
+  size += pool;
+  out = (uint8_t *)calloc(1, size);
+  pos = PATCHDB_HEADER_SIZE + num_bins * PATCHDB_INDEX_SIZE;
+  for (i = 0; i < num_bins; i++) {
+    const struct dbbinary *bin = &bins[i];
+    uint8_t *e = out + PATCHDB_HEADER_SIZE + i * PATCHDB_INDEX_SIZE;
+    uint8_t *r = out + pos;
+    WL32(e, bin->size);
+    WL32(e + 4, bin->crc);
+    WL32(e + 8, pos);
+    WL32(r, pool);
+    pool = add_string(out, pool, bin->name);
+    WL32(r + 4, pool);
+    pool = add_string(out, pool, bin->filename);
+    WL32(r + 8, bin->num);
+    for (j = 0; j < bin->num; j++) {
+      const struct dbpatch *dp = &bin->patches[j];
+      e = r + PATCHDB_RECORD_SIZE + j * PATCHDB_PATCH_SIZE;
+      WL32(e, dp->offset);
+      WL32(e + 4, pool);
+      memcpy(out + pool, dp->value, dp->len);
+      pool += dp->len;
+      WL32(e + 8, pool);
+      pool = add_string(out, pool, dp->name);
+      e[12] = dp->len;
+      e[13] = dp->len >> 8;
+      e[14] = dp->original;
+      e[15] = dp->last;
+    }
+    pos += PATCHDB_RECORD_SIZE + bin->num * PATCHDB_PATCH_SIZE;
+  }
+  memcpy(out, patchdb_magic, sizeof(patchdb_magic));
+  WL32(out + 8, version);
+  WL32(out + 12, num_bins);
+
+  fclose(f);
+  f = fopen(dst, "wb");
+  if (!f || fwrite(out, 1, size, f) != size || fclose(f)) {
+    printf("Could not write patch database %s\n", dst);
+    f = NULL;
+    goto cleanup;
+  }
+  f = NULL;
+  printf("Wrote %i binaries with %i patches to %s (version %u)\n", num_bins, total, dst, version);
+  res = 0;
+
+cleanup:
+  if (f)
+    fclose(f);
+  for (i = 0; i < num_bins; i++) {
+    for (j = 0; j < bins[i].num; j++) {
+      free(bins[i].patches[j].value);
+      free(bins[i].patches[j].name);
+    }
+    free(bins[i].patches);
+    free(bins[i].filename);
+    free(bins[i].name);
+  }
+  free(bins);
+  free(out);
+  return res;
+}
+
+/*
+ * Detection cache, so that running xwahacker repeatedly on the same file
+ * (e.g. listing and then changing resolutions) does not detect it again.
+ * Text file, a header line
+ * xwahacker-cache <format version> <checksum of the binary and patch tables>
+ * and then one line per file, most recently used first:
+ * <dev> <inode> <size> <mtime> <time stored> <binary index> <matches> <patches>\t<path>
+ * with the patches as hex bytes of a bit set of all built-in patches that
+ * check_patch matched, lowest patch in the least significant bit first.
+ * Binary and patch numbers are only valid for the tables they were stored
+ * with, so a cache with a different header is ignored as a whole.
+ * Like for the git index, an entry stored in the same second the file was
+ * modified might miss a later modification in that second, so it needs
+ * checking against the file.
+ */
+#define CACHE_MAX_ENTRIES 256
+#define CACHE_MATCH_BYTES ((NUM_PATCHES + 7) / 8)
+#define CACHE_KEY_SIZE 96
+#define CACHE_VERSION 2
+#define CACHE_HEADER_SIZE 64
+
+/// \return name of the cache file, NULL if caching is disabled
+static const char *cache_filename(void) {
+  static char name[1024];
+  const char *env = getenv("XWAHACKER_CACHE");
+  const char *dir;
+  if (env)
+    return env[0] ? env : NULL;
+#ifdef _WIN32
+  dir = getenv("TEMP");
+  if (dir && snprintf(name, sizeof(name), "%s\\xwahacker-cache.txt", dir) < (int)sizeof(name))
+    return name;
+#else
+  dir = getenv("HOME");
+  if (dir && snprintf(name, sizeof(name), "%s/.xwahacker-cache", dir) < (int)sizeof(name))
+    return name;
+#endif
+  return NULL;
+}
+
+/// Header line for a cache matching this version and its tables.
+static void cache_header(char *header) {
+  char buf[64];
+  uint32_t crc = 0xffffffff;
+  int i, j;
+  for (i = 0; binaries[i].name; i++) {
+    const enum PATCHES *g = binaries[i].patchgroups;
+    crc = update_crc(crc, (const uint8_t *)binaries[i].name, strlen(binaries[i].name) + 1);
+    for (j = 0; g[j] != NO_PATCH || g[j + 1] != NO_PATCH; j++) {
+      const struct patchdesc *p;
+      if (g[j] == NO_PATCH) {
+        crc = update_crc(crc, (const uint8_t *)"|", 1);
+        continue;
+      }
+      p = get_patchdesc(g[j]);
+      snprintf(buf, sizeof(buf), "%i %x %i %i ", g[j], p->offset, p->len, p->original);
+      crc = update_crc(crc, (const uint8_t *)buf, strlen(buf));
+      crc = update_crc(crc, p->value, p->len);
+    }
+  }
+  snprintf(header, CACHE_HEADER_SIZE, "xwahacker-cache %i %08x\n", CACHE_VERSION, (unsigned)~crc);
+}
+
+/// \return 0 if the file could not be found
+static int cache_key(const char *path, char *key, int64_t *mtime) {
+  struct stat st;
+  if (stat(path, &st))
+    return 0;
+  *mtime = st.st_mtime;
+  snprintf(key, CACHE_KEY_SIZE, "%lx %lx %lld %lld", (unsigned long)st.st_dev, (unsigned long)st.st_ino,
+           (long long)st.st_size, (long long)st.st_mtime);
+  return 1;
+}
+
+/// Set the bit of every built-in patch that is applied.
+static void patch_matches(uint8_t *buffer, struct exefile *f, uint8_t *matches) {
+  enum PATCHES p;
+  memset(matches, 0, CACHE_MATCH_BYTES);
+  for (p = FIRST_PATCH; p < NUM_PATCHES; p++)
+    if (check_patch(buffer, f, p, 1))
+      matches[p >> 3] |= 1 << (p & 7);
+}
+
+/**
+ * Look up a file that was not modified since it was cached.
+ * \param key set to the current key of the file
+ * \param racy set to 1 if the entry must be checked against the file
+ * \return 0 if the file is not in the cache
+ */
+static int cache_lookup(const char *path, char *key, int *binary, int *count, uint8_t *matches, int *racy) {
+  char line[4096];
+  char header[CACHE_HEADER_SIZE];
+  const char *name = cache_filename();
+  int64_t mtime;
+  long long stored;
+  int key_len;
+  int n = 0;
+  int found = 0;
+  FILE *f;
+  if (!name || !cache_key(path, key, &mtime) || !(f = fopen(name, "r")))
+    return 0;
+  cache_header(header);
+  if (!fgets(line, sizeof(line), f) || strcmp(line, header)) {
+    fclose(f);
+    return 0;
+  }
+  key_len = strlen(key);
+  while (fgets(line, sizeof(line), f)) {
+    char *tab = strchr(line, '\t');
+    int len = strlen(line);
+    int pos = 0;
+    int num_binaries = sizeof(binaries) / sizeof(*binaries) - 1;
+    if (!tab || line[len - 1] != '\n')
+      continue;
+    line[len - 1] = 0;
+    if (strcmp(tab + 1, path))
+      continue;
+    if (strncmp(line, key, key_len) || line[key_len] != ' ' ||
+        sscanf(line + key_len, " %lld %i %i %n", &stored, binary, count, &pos) != 3 || !pos ||
+        *binary < 0 || *binary >= num_binaries || *count <= 0)
+      break;
+    for (; line + key_len + pos + 2 <= tab && n < CACHE_MATCH_BYTES; pos += 2) {
+      unsigned v;
+      if (sscanf(line + key_len + pos, "%2x", &v) != 1)
+        break;
+      matches[n++] = v;
+    }
+    *racy = mtime >= stored;
+    found = n == CACHE_MATCH_BYTES && line + key_len + pos == tab;
+    break;
+  }
+  fclose(f);
+  return found;
+}
+
+/**
+ * Store the detection result for a file, replacing any older entry.
+ * A binary of -1 only removes the entry.
+ */
+static void cache_update(const char *path, int binary, int count, const uint8_t *matches) {
+  char line[4096];
+  char header[CACHE_HEADER_SIZE];
+  char key[CACHE_KEY_SIZE];
+  char tmpname[1040];
+  int64_t mtime;
+  const char *name = cache_filename();
+  int entries = 0;
+  int i;
+  FILE *in, *out;
+  unsigned long pid;
+#ifdef _WIN32
+  pid = GetCurrentProcessId();
+#else
+  pid = getpid();
+#endif
+  // per process, concurrent runs must not write into the same file
+  if (!name || snprintf(tmpname, sizeof(tmpname), "%s.%lu.tmp", name, pid) >= (int)sizeof(tmpname))
+    return;
+  out = fopen(tmpname, "w");
+  if (!out)
+    return;
+  cache_header(header);
+  fputs(header, out);
+  if (binary >= 0 && cache_key(path, key, &mtime)) {
+    fprintf(out, "%s %lld %i %i ", key, (long long)time(NULL), binary, count);
+    for (i = 0; i < CACHE_MATCH_BYTES; i++)
+      fprintf(out, "%02x", matches[i]);
+    fprintf(out, "\t%s\n", path);
+    entries++;
+  }
+  in = fopen(name, "r");
+  // entries of a cache for other tables are dropped
+  if (in && (!fgets(line, sizeof(line), in) || strcmp(line, header))) {
+    fclose(in);
+    in = NULL;
+  }
+  while (in && fgets(line, sizeof(line), in) && entries < CACHE_MAX_ENTRIES) {
+    char *tab = strchr(line, '\t');
+    int len = strlen(line);
+    if (!tab || line[len - 1] != '\n' || (strncmp(tab + 1, path, len - 2 - (tab - line)) == 0 &&
+                                          (int)strlen(path) == len - 2 - (tab - line)))
+      continue;
+    fputs(line, out);
+    entries++;
+  }
+  if (in)
+    fclose(in);
+  if (fclose(out)) {
+    remove(tmpname);
+    return;
+  }
+#ifdef _WIN32
+  // rename does not replace existing files on Windows
+  remove(name);
+#endif
+  if (rename(tmpname, name))
+    remove(tmpname);
+}
+
+/// Prefetch only what a command on an already detected binary might need.
+static void prefetch_binary(struct exefile *f, const struct binary *binary) {
+  const enum PATCHES *g = binary->patchgroups;
+  struct range *ranges = NULL;
+  int n = 0;
+  int i;
+  for (i = 0; g[i] != NO_PATCH || g[i + 1] != NO_PATCH; i++) {
+    if (g[i] == NO_PATCH)
+      continue;
+    ranges = (struct range *)realloc(ranges, (n + 1) * sizeof(*ranges));
+    ranges[n].offset = get_patchdesc(g[i])->offset;
+    ranges[n].len = get_patchdesc(g[i])->len;
+    n++;
+  }
+  for (i = 0; binary == &binaries[0] && i < NUM_PARAMS; i++) {
+    ranges = (struct range *)realloc(ranges, (n + 1) * sizeof(*ranges));
+    ranges[n].offset = paramdescs[i].offset;
+    ranges[n].len = paramdescs[i].len + param_size(paramdescs[i].type);
+    n++;
+  }
+  exefile_prefetch(f, ranges, n);
+  free(ranges);
+}
+
+/*
+ * Deltas use the IPS format: "PATCH", then records of a 24 bit big-endian
+ * offset and 16 bit length followed by the data (or, for length 0, a
+ * 16 bit count and the byte to repeat), then "EOF".
+ */
+#define IPS_MAX_OFFSET 0xffffff
+#define IPS_EOF 0x454f46
+
+struct delta_record {
+  int offset;
+  int len;
+  uint8_t *data;
+};
+
+/// \return 0 on write error or if offset cannot be represented
+static int write_ips_record(FILE *out, int offset, const uint8_t *data, int len) {
+  uint8_t hdr[5] = {offset >> 16, offset >> 8, offset, len >> 8, len};
+  if (offset > IPS_MAX_OFFSET)
+    return 0;
+  return fwrite(hdr, 1, 5, out) == 5 && fwrite(data, 1, len, out) == (size_t)len;
+}
+
+/**
+ * Write a delta against the unmodified original, one record for every patch
+ * group not in its original state and (for XWA) every changed parameter.
+ * The delta would not reproduce the state if any patch group is in an
+ * unknown state, so that is an error and no file is left behind.
+ * \return 0 on failure
+ */
+static int export_delta(uint8_t *buffer, struct exefile *f, const struct binary *binary, int is_xwa,
+                        const char *fname) {
+  uint8_t data[BUFFER_SZ + 1];
+  const enum PATCHES *g = binary->patchgroups;
+  int records = 0;
+  int group = 0;
+  int unknown = 0;
+  int ok = 1;
+  int i = 0;
+  FILE *out = fopen(fname, "wb");
+  if (!out) {
+    printf("Could not create %s: %s\n", fname, strerror(errno));
+    return 0;
+  }
+  ok = fwrite("PATCH", 1, 5, out) == 5;
+  while (ok && g[i] != NO_PATCH) {
+    enum PATCHES current = NO_PATCH;
+    for (; g[i] != NO_PATCH; i++)
+      if (current == NO_PATCH && check_patch(buffer, f, g[i], 1))
+        current = g[i];
+    i++;
+    group++;
+    if (current == NO_PATCH) {
+      printf("Unknown state of patch group %i, cannot be exported\n", group);
+      unknown++;
+      continue;
+    }
+    if (get_patchdesc(current)->original)
+      continue;
+    {
+      const struct patchdesc *p = get_patchdesc(current);
+      int offset = p->offset;
+      int len = p->len;
+      memcpy(data + 1, p->value, len);
+      // an offset spelling "EOF" would end the file, start a byte earlier
+      if (offset == IPS_EOF) {
+        if (!read_buffer(buffer, f, offset - 1, 1))
+          ok = 0;
+        data[0] = buffer[0];
+        offset--;
+        len++;
+      }
+      if (!write_ips_record(out, offset, offset == p->offset ? data + 1 : data, len)) {
+        printf("Could not write delta record for %s\n", get_patchname(current));
+        ok = 0;
+      }
+      records++;
+    }
+  }
+  for (i = 0; ok && is_xwa && i < NUM_PARAMS; i++) {
+    const struct paramdesc *pd = &paramdescs[i];
+    int size = param_size(pd->type);
+    uint32_t value;
+    if (!read_param(buffer, f, (enum PARAMS)i, &value) || value == pd->original)
+      continue;
+    if (size == 1)
+      data[0] = value;
+    else
+      WL32(data, value);
+    if (!write_ips_record(out, pd->offset + pd->len, data, size)) {
+      printf("Could not write delta record for %s\n", pd->name);
+      ok = 0;
+    }
+    records++;
+  }
+  if (ok)
+    ok = fwrite("EOF", 1, 3, out) == 3;
+  if (fclose(out))
+    ok = 0;
+  if (ok && unknown)
+    printf("%i patch groups in unknown state, the delta would be incomplete\n", unknown);
+  if (ok && !unknown) {
+    printf("Exported %i changes to %s\n", records, fname);
+    return 1;
+  }
+  printf("Exporting to %s failed\n", fname);
+  remove(fname);
+  return 0;
+}
+
+static void free_delta(struct delta_record *records, int num) {
+  int i;
+  for (i = 0; i < num; i++)
+    free(records[i].data);
+  free(records);
+}
+
+/**
+ * Read all records of an IPS file.
+ * \return 0 if the file could not be read or is invalid
+ */
+static int read_ips(const char *fname, struct delta_record **out, int *num) {
+  uint8_t hdr[5];
+  struct delta_record *records = NULL;
+  FILE *in = fopen(fname, "rb");
+  *num = 0;
+  if (!in) {
+    printf("Could not open %s: %s\n", fname, strerror(errno));
+    return 0;
+  }
+  if (fread(hdr, 1, 5, in) != 5 || memcmp(hdr, "PATCH", 5))
+    goto err_out;
+  for (;;) {
+    struct delta_record r;
+    if (fread(hdr, 1, 3, in) != 3)
+      goto err_out;
+    if (memcmp(hdr, "EOF", 3) == 0)
+      break;
+    r.offset = hdr[0] << 16 | hdr[1] << 8 | hdr[2];
+    if (fread(hdr, 1, 2, in) != 2)
+      goto err_out;
+    r.len = hdr[0] << 8 | hdr[1];
+    if (r.len) {
+      r.data = (uint8_t *)malloc(r.len);
+      if (fread(r.data, 1, r.len, in) != (size_t)r.len) {
+        free(r.data);
+        goto err_out;
+      }
+    } else {
+      // run-length encoded record
+      if (fread(hdr, 1, 3, in) != 3)
+        goto err_out;
+      r.len = hdr[0] << 8 | hdr[1];
+      if (!r.len)
+        goto err_out;
+      r.data = (uint8_t *)malloc(r.len);
+      memset(r.data, hdr[2], r.len);
+    }
+    records = (struct delta_record *)realloc(records, (*num + 1) * sizeof(*records));
+    records[(*num)++] = r;
+  }
+  fclose(in);
+  *out = records;
+  return 1;
+
+err_out:
+  printf("%s is not a valid IPS file\n", fname);
+  fclose(in);
+  free_delta(records, *num);
+  return 0;
+}
+
+/**
+ * Find the patch or parameter a write of data at offset corresponds to.
+ * \param patch set to the patch, NO_PATCH for a parameter
+ * \param param set to the parameter if patch is NO_PATCH
+ * \return number of bytes covered, 0 if no patch or parameter matches
+ */
+static int match_delta(uint8_t *buffer, struct exefile *f, const struct binary *binary, int is_xwa,
+                       int offset, const uint8_t *data, int len, enum PATCHES *patch, enum PARAMS *param) {
+  const enum PATCHES *g = binary->patchgroups;
+  int i;
+  *patch = NO_PATCH;
+  for (i = 0; g[i] != NO_PATCH || g[i + 1] != NO_PATCH; i++) {
+    const struct patchdesc *p;
+    if (g[i] == NO_PATCH)
+      continue;
+    p = get_patchdesc(g[i]);
+    if (p->offset == offset && p->len <= len && memcmp(p->value, data, p->len) == 0) {
+      *patch = g[i];
+      return p->len;
+    }
+  }
+  for (i = 0; is_xwa && i < NUM_PARAMS; i++) {
+    const struct paramdesc *pd = &paramdescs[i];
+    uint32_t value;
+    if (pd->offset + pd->len == offset && param_size(pd->type) <= len &&
+        read_param(buffer, f, (enum PARAMS)i, &value)) {
+      *param = (enum PARAMS)i;
+      return param_size(pd->type);
+    }
+  }
+  return 0;
+}
+
+/**
+ * Apply an IPS delta. Every byte it changes must belong to a patch of the
+ * detected binary's patch groups or to a parameter, which is checked for
+ * the whole delta before anything is written.
+ * \return 0 on failure
+ */
+static int import_delta(uint8_t *buffer, struct exefile *f, const struct binary *binary, int is_xwa,
+                        const char *fname) {
+  int num;
+  int pass, i;
+  int changes = 0;
+  struct delta_record *records = NULL;
+  if (!read_ips(fname, &records, &num))
+    return 0;
+  // first pass validates, second pass writes
+  for (pass = 0; pass < 2; pass++) {
+    for (i = 0; i < num; i++) {
+      const struct delta_record *r = &records[i];
+      int pos = 0;
+      while (pos < r->len) {
+        enum PATCHES patch;
+        enum PARAMS param = (enum PARAMS)0;
+        int n = match_delta(buffer, f, binary, is_xwa, r->offset + pos, r->data + pos, r->len - pos, &patch, &param);
+        // bytes that do not change anything, e.g. context from other tools
+        if (!n && read_buffer(buffer, f, r->offset + pos, 1) && buffer[0] == r->data[pos]) {
+          pos++;
+          continue;
+        }
+        if (!n) {
+          printf("Change at offset 0x%x does not match any patch of %s, no changes made\n",
+                 r->offset + pos, binary->name);
+          goto fail;
+        }
+        if (pass && patch != NO_PATCH && !apply_patch(buffer, f, binary->patchgroups, patch))
+          goto fail;
+        if (pass && patch == NO_PATCH) {
+          const uint8_t *v = r->data + pos;
+          if (!write_param(buffer, f, param, n == 1 ? v[0] : RL32(v))) {
+            printf("Failed setting %s\n", paramdescs[param].name);
+            goto fail;
+          }
+          printf("Changed %s\n", paramdescs[param].name);
+        }
+        changes += pass;
+        pos += n;
+      }
+    }
+  }
+  printf("Imported %i changes from %s\n", changes, fname);
+  free_delta(records, num);
+  return 1;
+
+fail:
+  free_delta(records, num);
+  return 0;
+}
+
+#ifdef __linux__
+#define MAX_WATCH_ACTIONS 16
+
+struct watch_action {
+  char type; ///< 'p', 'c' or 'm' like the corresponding command line options
+  int num;
+};
+
+struct watch_entry {
+  char *path;
+  const char *name; ///< file name part of path, as reported by inotify
+  int wd;           ///< -1 while the directory is not watched
+  int watch_failed; ///< adding the watch failed, already reported
+  int num_actions;
+  struct watch_action actions[MAX_WATCH_ACTIONS];
+};
+
+/**
+ * Parse a watch list line of the form "-c 3 -p 71 path/to/xwingalliance.exe".
+ * \return 0 if the line is invalid
+ */
+static int parse_watch_line(struct watch_entry *e, char *line, int need_actions) {
+  char *slash;
+  int len;
+  memset(e, 0, sizeof(*e));
+  while (*line == ' ' || *line == '\t') line++;
+  while (line[0] == '-' && strchr("pcm", line[1]) && (line[2] == ' ' || line[2] == '\t')) {
+    char *end;
+    long num = strtol(line + 3, &end, 10);
+    if (end == line + 3 || num < 0 || e->num_actions >= MAX_WATCH_ACTIONS)
+      return 0;
+    e->actions[e->num_actions].type = line[1];
+    e->actions[e->num_actions].num = num;
+    e->num_actions++;
+    line = end;
+    while (*line == ' ' || *line == '\t') line++;
+  }
+  len = strlen(line);
+  while (len > 0 && strchr(" \t\r\n", line[len - 1]))
+    len--;
+  line[len] = 0;
+  if (!len || (need_actions && !e->num_actions))
+    return 0;
+  e->path = strdup(line);
+  slash = strrchr(e->path, '/');
+  e->name = slash ? slash + 1 : e->path;
+  return 1;
+}
+
+/**
+ * Check if an action is valid for the given binary
+ * \return 0 if the action cannot be applied
+ */
+static int watch_action_valid(const struct binary *binary, const struct watch_action *a) {
+  switch (a->type) {
+  case 'p':
+    return a->num < NUM_PATCHES + ext_num_patches && find_patchgroup(binary->patchgroups, a->num);
+  case 'c':
+    return binary->collections && a->num < num_collections(binary->collections);
+  case 'm':
+    return a->num < num_metapatches();
+  }
+  return 0;
+}
+
+/**
+ * \return 1 if the file already is in the state the action would produce
+ */
+static int watch_action_applied(uint8_t *buffer, struct exefile *f, const struct binary *binary,
+                                const struct watch_action *a) {
+  const enum PATCHES *patches;
+  int i;
+  switch (a->type) {
+  case 'p':
+    return check_patch(buffer, f, a->num, 1);
+  case 'c':
+    patches = binary->collections[a->num].patches;
+    break;
+  default:
+    patches = metapatches[a->num].patches;
+    break;
+  }
+  for (i = 0; patches[i] != NO_PATCH; i++) {
+    if (find_patchgroup(binary->patchgroups, patches[i]) &&
+        !check_patch(buffer, f, patches[i], 1))
+      return 0;
+  }
+  return 1;
+}
+
+/**
+ * Bring a watched file into the configured state.
+ * The file is only opened for writing if something needs changing, since
+ * closing a writable file would trigger another IN_CLOSE_WRITE event.
+ */
+static void watch_apply(struct watch_entry *e) {
+  uint8_t buffer[BUFFER_SZ];
+  const struct binary *binary;
+  int count;
+  int i;
+  int uptodate = 1;
+  struct exefile *f = exefile_open(e->path, 0);
+  if (!f) {
+    printf("%s: could not open file: %s\n", e->path, strerror(errno));
+    return;
+  }
+  prefetch_all(f);
+  binary = detect_file(buffer, f, &count);
+  if (!count) {
+    printf("%s: could not detect file, not patching\n", e->path);
+    goto cleanup;
+  }
+  for (i = 0; i < e->num_actions; i++) {
+    if (!watch_action_valid(binary, &e->actions[i])) {
+      printf("%s: option -%c %i not supported for %s\n", e->path,
+             e->actions[i].type, e->actions[i].num, binary->name);
+      goto cleanup;
+    }
+    if (!watch_action_applied(buffer, f, binary, &e->actions[i]))
+      uptodate = 0;
+  }
+  if (uptodate)
+    goto cleanup;
+
+  exefile_close(f);
+  f = exefile_open(e->path, 1);
+  if (!f) {
+    printf("%s: could not open file for writing: %s\n", e->path, strerror(errno));
+    return;
+  }
+  prefetch_all(f);
+  if (binary == &ext_binary)
+    prefetch_ext(f);
+  printf("%s: re-applying state to %s\n", e->path, binary->name);
+  for (i = 0; i < e->num_actions; i++) {
+    int num = e->actions[i].num;
+    int ok;
+    switch (e->actions[i].type) {
+    case 'p': ok = apply_patch(buffer, f, binary->patchgroups, num); break;
+    case 'c': ok = apply_collection(buffer, f, binary, num); break;
+    default:  ok = apply_metapatch(buffer, f, binary, num); break;
+    }
+    if (!ok) {
+      printf("%s: patching failed\n", e->path);
+      break;
+    }
+  }
+
+cleanup:
+  if (!exefile_close(f))
+    printf("%s: writing changes failed\n", e->path);
+  fflush(stdout);
+}
+
+/**
+ * Watch the parent directory of a file.
+ * Failures are only reported once, the caller retries until it works.
+ * \return 0 if the directory could not be watched
+ */
+static int watch_add(int fd, struct watch_entry *e) {
+  char *dir = strdup(e->path);
+  if (e->name == e->path)
+    strcpy(dir, ".");
+  else
+    dir[e->name - e->path - 1] = 0;
+  e->wd = inotify_add_watch(fd, dir[0] ? dir : "/", IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVE_SELF);
+  if (e->wd < 0 && !e->watch_failed)
+    printf("Could not watch directory %s: %s, retrying\n", dir, strerror(errno));
+  else if (e->wd >= 0 && e->watch_failed)
+    printf("Watching directory %s again\n", dir);
+  e->watch_failed = e->wd < 0;
+  free(dir);
+  return e->wd >= 0;
+}
+
+/**
+ * Keep the files listed in watchlist in the configured state, re-applying
+ * it whenever something else (e.g. an updater) replaces or modifies them.
+ * The parent directories are watched so that replacing a file via rename
+ * is noticed as well.
+ * A directory that is deleted, moved away or cannot be watched yet is
+ * watched again as soon as possible, and since no event can be trusted to
+ * have been seen after that or after an event queue overflow, the
+ * affected files are checked again.
+ */
+static int watch_main(const char *watchlist) {
+  char line[4096];
+  struct watch_entry *entries = NULL;
+  int num_entries = 0;
+  int fd = -1;
+  int i;
+  int lineno = 0;
+  FILE *list = fopen(watchlist, "r");
+  if (!list) {
+    printf("Could not open watch list %s: %s\n", watchlist, strerror(errno));
+    return 1;
+  }
+  while (fgets(line, sizeof(line), list)) {
+    struct watch_entry e;
+    lineno++;
+    if (line[strspn(line, " \t\r\n")] == 0 || line[0] == '#')
+      continue;
+    if (!parse_watch_line(&e, line, 1)) {
+      printf("Invalid line %i in watch list %s\n", lineno, watchlist);
+      fclose(list);
+      goto cleanup;
+    }
+    entries = realloc(entries, (num_entries + 1) * sizeof(*entries));
+    entries[num_entries++] = e;
+  }
+  fclose(list);
+  if (!num_entries) {
+    printf("Watch list %s does not contain any files\n", watchlist);
+    goto cleanup;
+  }
+
+  fd = inotify_init();
+  if (fd < 0) {
+    printf("Could not initialize inotify: %s\n", strerror(errno));
+    goto cleanup;
+  }
+  for (i = 0; i < num_entries; i++) {
+    watch_add(fd, &entries[i]);
+    watch_apply(&entries[i]);
+  }
+  printf("Watching %i files\n", num_entries);
+  fflush(stdout);
+
+  for (;;) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const char *ptr;
+    struct pollfd pfd;
+    int unwatched = 0;
+    ssize_t len;
+    for (i = 0; i < num_entries; i++)
+      if (entries[i].wd < 0 && watch_add(fd, &entries[i]))
+        watch_apply(&entries[i]);
+      else if (entries[i].wd < 0)
+        unwatched++;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    // wake up regularly to retry directories that could not be watched
+    if (poll(&pfd, 1, unwatched ? 1000 : -1) == 0)
+      continue;
+    len = read(fd, buf, sizeof(buf));
+    if (len < 0 && (errno == EINTR || errno == EAGAIN))
+      continue;
+    if (len <= 0) {
+      printf("Reading inotify events failed: %s\n", strerror(errno));
+      break;
+    }
+    for (ptr = buf; ptr < buf + len; ptr += sizeof(struct inotify_event) + ((const struct inotify_event *)ptr)->len) {
+      const struct inotify_event *ev = (const struct inotify_event *)ptr;
+      if (ev->mask & IN_Q_OVERFLOW) {
+        printf("Too many file system events, checking all files\n");
+        for (i = 0; i < num_entries; i++)
+          watch_apply(&entries[i]);
+        continue;
+      }
+      // the watch stays on a directory moved away, remove it to get IN_IGNORED
+      if (ev->mask & IN_MOVE_SELF)
+        inotify_rm_watch(fd, ev->wd);
+      if (ev->mask & IN_IGNORED) {
+        for (i = 0; i < num_entries; i++)
+          if (entries[i].wd == ev->wd)
+            entries[i].wd = -1;
+        continue;
+      }
+      if (!ev->len)
+        continue;
+      for (i = 0; i < num_entries; i++)
+        if (entries[i].wd == ev->wd && strcmp(entries[i].name, ev->name) == 0)
+          watch_apply(&entries[i]);
+    }
+  }
+
+cleanup:
+  if (fd >= 0)
+    close(fd);
+  for (i = 0; i < num_entries; i++)
+    free(entries[i].path);
+  free(entries);
+  return 1;
+}
+
+/**
+ * Identifies a file state for the fleet journal: size and modification
+ * time catch any later change, the header CRC a replaced file.
+ * The modification time has nanosecond resolution where the libc provides
+ * it, otherwise a change within the same second goes unnoticed.
+ */
+struct file_id {
+  int valid;
+  int64_t size;
+  int64_t mtime_ns;
+  uint32_t crc;
+};
+
+/// \return nanoseconds part of the modification time, 0 if not available
+static long mtime_nsec(const struct stat *st) {
+#if defined(st_mtime)
+  // POSIX.1-2008 struct timespec member
+  return st->st_mtim.tv_nsec;
+#elif defined(__GLIBC__)
+  return st->st_mtimensec;
+#else
+  return 0;
+#endif
+}
+
+static void get_file_id(const char *path, struct file_id *id) {
+  uint8_t buffer[BUFFER_SZ];
+  struct stat st;
+  uint32_t size;
+  struct exefile *f;
+  memset(id, 0, sizeof(*id));
+  if (stat(path, &st) || !(f = exefile_open(path, 0)))
+    return;
+  id->valid = fingerprint(buffer, f, &size, &id->crc) && size == st.st_size;
+  id->size = st.st_size;
+  id->mtime_ns = (int64_t)st.st_mtime * 1000000000 + mtime_nsec(&st);
+  exefile_close(f);
+}
+
+enum FLEET_OP {
+  FLEET_PATCH,
+  FLEET_VERIFY,
+  FLEET_INVENTORY,
+  NUM_FLEET_OPS
+};
+
+static const char * const fleetopnames[NUM_FLEET_OPS] = {
+  [FLEET_PATCH]     = "patch",
+  [FLEET_VERIFY]    = "verify",
+  [FLEET_INVENTORY] = "inventory",
+};
+
+/// what a worker reports back, followed by a message for the user
+struct fleet_result {
+  int ok;
+  int64_t bytes;
+  int64_t ios;
+  struct file_id id; ///< of the file after the job, for the journal
+};
+
+#define FLEET_MSG_SIZE 1024
+
+/**
+ * Patch, verify or inventory one file, run in a worker process.
+ * \return 1 on success
+ */
+static int fleet_job(enum FLEET_OP op, const struct watch_entry *e, char *msg) {
+  uint8_t buffer[BUFFER_SZ];
+  const struct binary *binary;
+  const enum PATCHES *g;
+  int count;
+  int i;
+  int ok = 1;
+  int uptodate = 1;
+  struct exefile *f = exefile_open(e->path, op == FLEET_PATCH);
+  if (!f) {
+    snprintf(msg, FLEET_MSG_SIZE, "could not open file: %s", strerror(errno));
+    return 0;
+  }
+  prefetch_all(f);
+  binary = detect_file(buffer, f, &count);
+  if (!count) {
+    snprintf(msg, FLEET_MSG_SIZE, "could not detect file");
+    ok = 0;
+    goto cleanup;
+  }
+  if (op == FLEET_INVENTORY) {
+    int len = snprintf(msg, FLEET_MSG_SIZE, "%s, patches", binary->name);
+    g = binary->patchgroups;
+    for (i = 0; g[i] != NO_PATCH || g[i + 1] != NO_PATCH; i++)
+      if (g[i] != NO_PATCH && len < FLEET_MSG_SIZE && check_patch(buffer, f, g[i], 1))
+        len += snprintf(msg + len, FLEET_MSG_SIZE - len, " %i", g[i]);
+    goto cleanup;
+  }
+  for (i = 0; i < e->num_actions; i++) {
+    if (!watch_action_valid(binary, &e->actions[i])) {
+      snprintf(msg, FLEET_MSG_SIZE, "option -%c %i not supported for %s",
+               e->actions[i].type, e->actions[i].num, binary->name);
+      ok = 0;
+      goto cleanup;
+    }
+    if (!watch_action_applied(buffer, f, binary, &e->actions[i]))
+      uptodate = 0;
+  }
+  if (op == FLEET_VERIFY || uptodate) {
+    snprintf(msg, FLEET_MSG_SIZE, uptodate ? "%s in configured state" : "%s not in configured state", binary->name);
+    ok = uptodate || op == FLEET_PATCH;
+    goto cleanup;
+  }
+  for (i = 0; ok && i < e->num_actions; i++) {
+    int num = e->actions[i].num;
+    switch (e->actions[i].type) {
+    case 'p': ok = apply_patch(buffer, f, binary->patchgroups, num); break;
+    case 'c': ok = apply_collection(buffer, f, binary, num); break;
+    default:  ok = apply_metapatch(buffer, f, binary, num); break;
+    }
+  }
+  snprintf(msg, FLEET_MSG_SIZE, ok ? "patched %s" : "patching %s failed, no changes made", binary->name);
+
+cleanup:
+  if (!ok)
+    exefile_discard(f);
+  if (!exefile_close(f)) {
+    snprintf(msg, FLEET_MSG_SIZE, "writing changes failed");
+    ok = 0;
+  }
+  return ok;
+}
+
+/**
+ * Token bucket for an I/O budget, it may go into debt since the actual
+ * cost of a job is only known when it is done.
+ */
+struct io_budget {
+  double rate;   ///< per second, 0 for unlimited
+  double tokens;
+  int64_t last;
+};
+
+static void budget_refill(struct io_budget *b, int64_t now) {
+  b->tokens += b->rate * (now - b->last) / 1e6;
+  // allow bursts of up to a second worth of I/O
+  if (b->tokens > b->rate)
+    b->tokens = b->rate;
+  b->last = now;
+}
+
+/// \return microseconds until the budget allows starting another job
+static int64_t budget_wait(const struct io_budget *b) {
+  if (!b->rate || b->tokens >= 0)
+    return 0;
+  return -b->tokens / b->rate * 1e6 + 1;
+}
+
+static void budget_charge(struct io_budget *b, double cost) {
+  if (b->rate)
+    b->tokens -= cost;
+}
+
+struct fleet_host {
+  char *name;
+  int *queue;   ///< entry indices
+  int num;
+  int next;     ///< first entry not started yet
+  int running;
+};
+
+struct fleet_worker {
+  pid_t pid;    ///< 0 if idle
+  int fd;
+  int entry;
+  int host;
+  int home;     ///< host this worker prefers, others are only helped out
+  double estimate[2];
+  int len;
+  char buf[sizeof(struct fleet_result) + FLEET_MSG_SIZE];
+};
+
+static int fleet_host_index(struct fleet_host **hosts, int *num_hosts, const char *name) {
+  int i;
+  for (i = 0; i < *num_hosts; i++)
+    if (strcmp((*hosts)[i].name, name) == 0)
+      return i;
+  *hosts = (struct fleet_host *)realloc(*hosts, (*num_hosts + 1) * sizeof(**hosts));
+  memset(&(*hosts)[i], 0, sizeof(**hosts));
+  (*hosts)[i].name = strdup(name);
+  return (*num_hosts)++;
+}
+
+/**
+ * Pick the next job for a worker: from its home host if possible,
+ * otherwise steal from the host with the most remaining work.
+ * \return host index, -1 if nothing can be started now
+ */
+static int fleet_pick(const struct fleet_host *hosts, int num_hosts, int home, int per_host) {
+  int best = -1;
+  int i;
+  if (hosts[home].next < hosts[home].num && hosts[home].running < per_host)
+    return home;
+  for (i = 0; i < num_hosts; i++) {
+    int left = hosts[i].num - hosts[i].next;
+    if (left > 0 && hosts[i].running < per_host &&
+        (best < 0 || left > hosts[best].num - hosts[best].next))
+      best = i;
+  }
+  return best;
+}
+
+static void fleet_start(struct fleet_worker *w, enum FLEET_OP op, const struct watch_entry *e) {
+  int fds[2];
+  if (pipe(fds)) {
+    w->pid = -1;
+    return;
+  }
+  fflush(stdout);
+  w->pid = fork();
+  if (w->pid == 0) {
+    struct stats counters;
+    struct fleet_result r;
+    char msg[sizeof(r) + FLEET_MSG_SIZE];
+    int null = open("/dev/null", O_WRONLY);
+    // the messages of the patching code would be interleaved
+    dup2(null, 1);
+    close(fds[0]);
+    memset(&counters, 0, sizeof(counters));
+    stats = &counters;
+    memset(msg, 0, sizeof(msg));
+    r.ok = fleet_job(op, e, msg + sizeof(r));
+    get_file_id(e->path, &r.id);
+    r.bytes = counters.counters[CNT_BYTES_READ] + counters.counters[CNT_BYTES_WRITTEN];
+    r.ios = counters.counters[CNT_READS] + counters.counters[CNT_WRITES];
+    memcpy(msg, &r, sizeof(r));
+    // a single write below PIPE_BUF is atomic
+    _exit(write(fds[1], msg, sizeof(r) + strlen(msg + sizeof(r)) + 1) <= 0);
+  }
+  close(fds[1]);
+  if (w->pid < 0) {
+    close(fds[0]);
+    return;
+  }
+  w->fd = fds[0];
+  w->len = 0;
+}
+
+/// one line of the fleet journal
+struct journal_entry {
+  char *path;
+  char *plan;
+  char *msg;  ///< result message of the job
+  struct file_id id;
+  int ok;
+  int seq;    ///< line number, later lines override earlier ones
+};
+
+/// describe what a fleet job does to a file, to recognize it in the journal
+static void fleet_plan(enum FLEET_OP op, const struct watch_entry *e, char *plan, int size) {
+  int len = snprintf(plan, size, "%s", fleetopnames[op]);
+  int i;
+  for (i = 0; i < e->num_actions && len < size; i++)
+    len += snprintf(plan + len, size - len, " -%c %i", e->actions[i].type, e->actions[i].num);
+}
+
+static int cmp_journal(const void *a, const void *b) {
+  const struct journal_entry *x = (const struct journal_entry *)a;
+  const struct journal_entry *y = (const struct journal_entry *)b;
+  int res = strcmp(x->path, y->path);
+  return res ? res : x->seq - y->seq;
+}
+
+/**
+ * Read a fleet journal, sorted by path for journal_find.
+ * Incomplete lines, e.g. from a crash while writing, are ignored.
+ */
+static struct journal_entry *read_journal(const char *fname, int *num) {
+  char line[4096];
+  struct journal_entry *entries = NULL;
+  FILE *f = fopen(fname, "r");
+  *num = 0;
+  if (!f)
+    return NULL;
+  while (fgets(line, sizeof(line), f)) {
+    char *fields[7];
+    struct journal_entry je;
+    int len = strlen(line);
+    int i;
+    if (!len || line[len - 1] != '\n')
+      continue;
+    line[len - 1] = 0;
+    fields[0] = line;
+    for (i = 1; i < 7 && (fields[i] = strchr(fields[i - 1], '\t')); i++)
+      *fields[i]++ = 0;
+    if (i < 7)
+      continue;
+    je.ok = strcmp(fields[0], "ok") == 0;
+    je.id.valid = 1;
+    je.id.size = strtoll(fields[1], NULL, 10);
+    je.id.mtime_ns = strtoll(fields[2], NULL, 10);
+    je.id.crc = strtoul(fields[3], NULL, 16);
+    je.plan = strdup(fields[4]);
+    je.msg = strdup(fields[5]);
+    je.path = strdup(fields[6]);
+    je.seq = *num;
+    entries = (struct journal_entry *)realloc(entries, (*num + 1) * sizeof(*entries));
+    entries[(*num)++] = je;
+  }
+  fclose(f);
+  qsort(entries, *num, sizeof(*entries), cmp_journal);
+  return entries;
+}
+
+/// \return the last journal entry for path, NULL if there is none
+static const struct journal_entry *journal_find(const struct journal_entry *entries, int num, const char *path) {
+  int lo = 0;
+  int hi = num;
+  // first entry with a larger path, the one before is the last for path
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (strcmp(entries[mid].path, path) <= 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo > 0 && strcmp(entries[lo - 1].path, path) == 0 ? &entries[lo - 1] : NULL;
+}
+
+/**
+ * Append the result of a job to the journal, synced so that it survives
+ * a crash or reboot right after.
+ * The message is kept so that a resumed run can still report skipped files.
+ */
+static void journal_add(FILE *journal, const char *path, const char *plan, const struct fleet_result *r,
+                        const char *msg) {
+  char clean[FLEET_MSG_SIZE];
+  int i;
+  snprintf(clean, sizeof(clean), "%s", msg);
+  // the message is a field of a tab separated line
+  for (i = 0; clean[i]; i++)
+    if (clean[i] == '\t' || clean[i] == '\n' || clean[i] == '\r')
+      clean[i] = ' ';
+  fprintf(journal, "%s\t%lld\t%lld\t%08x\t%s\t%s\t%s\n", r->ok && r->id.valid ? "ok" : "failed",
+          (long long)r->id.size, (long long)r->id.mtime_ns, r->id.crc, plan, clean, path);
+  fflush(journal);
+  fsync(fileno(journal));
+}
+
+/**
+ * Run a patch, verify or inventory operation over all files in a list in
+ * worker processes, limited by per-host concurrency and I/O budgets.
+ * The list uses the --watch format, a line may start with "@<host>" to
+ * group files by host, otherwise they are grouped by file system.
+ */
+static int fleet_main(int argc, char *argv[]) {
+  char line[4096];
+  struct watch_entry *entries = NULL;
+  struct fleet_host *hosts = NULL;
+  struct fleet_worker *workers;
+  struct io_budget budgets[2];   ///< bytes and I/O operations
+  struct pollfd *pfds;
+  int *slots;   ///< worker of each pfds entry
+  enum FLEET_OP op;
+  int num_entries = 0;
+  int num_hosts = 0;
+  int num_workers = 4;
+  int per_host = 2;
+  int done = 0, failed = 0, skipped = 0;
+  const char *journal_name = NULL;
+  struct journal_entry *journal_entries = NULL;
+  int num_journal = 0;
+  FILE *journal = NULL;
+  char plan[256];
+  int64_t total[2] = {0, 0};
+  int64_t start = time_us();
+  int lineno = 0;
+  int i, j;
+  FILE *list;
+
+  memset(budgets, 0, sizeof(budgets));
+  for (; argc > 2 && argv[0][0] == '-'; argc -= 2, argv += 2) {
+    double v = atof(argv[1]);
+    if (strcmp(argv[0], "--journal") == 0)
+      journal_name = argv[1];
+    else if (strcmp(argv[0], "--jobs") == 0 && v >= 1)
+      num_workers = v;
+    else if (strcmp(argv[0], "--per-host") == 0 && v >= 1)
+      per_host = v;
+    else if (strcmp(argv[0], "--bw") == 0 && v > 0)
+      budgets[0].rate = v * 1024 * 1024;
+    else if (strcmp(argv[0], "--iops") == 0 && v > 0)
+      budgets[1].rate = v;
+    else
+      break;
+  }
+  if (argc != 2)
+    return -1;
+  for (op = FLEET_PATCH; op < NUM_FLEET_OPS && strcmp(argv[0], fleetopnames[op]); op = (enum FLEET_OP)(op + 1)) /* */;
+  if (op == NUM_FLEET_OPS)
+    return -1;
+
+  list = fopen(argv[1], "r");
+  if (!list) {
+    printf("Could not open file list %s: %s\n", argv[1], strerror(errno));
+    return 1;
+  }
+  if (journal_name) {
+    journal_entries = read_journal(journal_name, &num_journal);
+    journal = fopen(journal_name, "a");
+    if (!journal) {
+      printf("Could not open journal %s: %s\n", journal_name, strerror(errno));
+      fclose(list);
+      return 1;
+    }
+  }
+  while (fgets(line, sizeof(line), list)) {
+    struct watch_entry e;
+    struct stat st;
+    char host[256];
+    char *rest = line + strspn(line, " \t");
+    int n = 0;
+    lineno++;
+    if (rest[strspn(rest, "\r\n")] == 0 || rest[0] == '#')
+      continue;
+    if (rest[0] == '@' && sscanf(rest, "@%255s %n", host, &n) == 1 && n)
+      rest += n;
+    else
+      host[0] = 0;
+    if (!parse_watch_line(&e, rest, op != FLEET_INVENTORY)) {
+      printf("Invalid line %i in file list %s\n", lineno, argv[1]);
+      fclose(list);
+      return 1;
+    }
+    if (journal) {
+      // skip files that are still in the state a completed job left them in
+      const struct journal_entry *je = journal_find(journal_entries, num_journal, e.path);
+      struct file_id id;
+      fleet_plan(op, &e, plan, sizeof(plan));
+      if (je && je->ok && strcmp(je->plan, plan) == 0) {
+        get_file_id(e.path, &id);
+        if (id.valid && id.size == je->id.size && id.mtime_ns == je->id.mtime_ns && id.crc == je->id.crc) {
+          printf("%s: %s (unchanged since journal)\n", e.path, je->msg);
+          free(e.path);
+          skipped++;
+          continue;
+        }
+      }
+    }
+    if (!host[0])
+      snprintf(host, sizeof(host), "device %lx", stat(e.path, &st) ? 0ul : (unsigned long)st.st_dev);
+    j = fleet_host_index(&hosts, &num_hosts, host);
+    hosts[j].queue = (int *)realloc(hosts[j].queue, (hosts[j].num + 1) * sizeof(*hosts[j].queue));
+    hosts[j].queue[hosts[j].num++] = num_entries;
+    entries = (struct watch_entry *)realloc(entries, (num_entries + 1) * sizeof(*entries));
+    entries[num_entries++] = e;
+  }
+  fclose(list);
+  for (i = 0; i < num_journal; i++) {
+    free(journal_entries[i].path);
+    free(journal_entries[i].plan);
+    free(journal_entries[i].msg);
+  }
+  free(journal_entries);
+  if (!num_entries && skipped) {
+    printf("%s: all %i files already done according to journal\n", fleetopnames[op], skipped);
+    fclose(journal);
+    return 0;
+  }
+  if (!num_entries) {
+    printf("File list %s does not contain any files\n", argv[1]);
+    if (journal)
+      fclose(journal);
+    return 1;
+  }
+
+  workers = (struct fleet_worker *)calloc(num_workers, sizeof(*workers));
+  pfds = (struct pollfd *)calloc(num_workers, sizeof(*pfds));
+  slots = (int *)calloc(num_workers, sizeof(*slots));
+  for (i = 0; i < num_workers; i++)
+    workers[i].home = i % num_hosts;
+  for (i = 0; i < 2; i++) {
+    budgets[i].tokens = budgets[i].rate;
+    budgets[i].last = start;
+  }
+
+  while (done < num_entries) {
+    int64_t now = time_us();
+    int64_t wait = 0;
+    int num_fds = 0;
+    for (i = 0; i < 2; i++) {
+      budget_refill(&budgets[i], now);
+      if (budget_wait(&budgets[i]) > wait)
+        wait = budget_wait(&budgets[i]);
+    }
+    for (i = 0; i < num_workers && !wait; i++) {
+      struct fleet_worker *w = &workers[i];
+      int h;
+      if (w->pid)
+        continue;
+      h = fleet_pick(hosts, num_hosts, w->home, per_host);
+      if (h < 0)
+        break;
+      w->host = h;
+      w->entry = hosts[h].queue[hosts[h].next++];
+      fleet_start(w, op, &entries[w->entry]);
+      if (w->pid < 0) {
+        printf("%s: could not start worker: %s\n", entries[w->entry].path, strerror(errno));
+        w->pid = 0;
+        done++;
+        failed++;
+        continue;
+      }
+      hosts[h].running++;
+      // charge what an average job cost so far, corrected when it is done
+      for (j = 0; j < 2; j++) {
+        w->estimate[j] = done ? total[j] / (double)done : 0;
+        budget_charge(&budgets[j], w->estimate[j]);
+        if (budget_wait(&budgets[j]) > wait)
+          wait = budget_wait(&budgets[j]);
+      }
+    }
+    for (i = 0; i < num_workers; i++) {
+      if (!workers[i].pid)
+        continue;
+      pfds[num_fds].fd = workers[i].fd;
+      pfds[num_fds].events = POLLIN;
+      pfds[num_fds].revents = 0;
+      slots[num_fds++] = i;
+    }
+    if (!num_fds && !wait)
+      break;
+    if (poll(pfds, num_fds, wait ? (int)(wait / 1000) + 1 : -1) < 0 && errno != EINTR)
+      break;
+    for (i = 0; i < num_fds; i++) {
+      struct fleet_worker *w = &workers[slots[i]];
+      struct fleet_result r;
+      ssize_t res;
+      if (!pfds[i].revents)
+        continue;
+      res = read(w->fd, w->buf + w->len, sizeof(w->buf) - 1 - w->len);
+      if (res < 0 && (errno == EINTR || errno == EAGAIN))
+        continue;
+      if (res > 0) {
+        w->len += res;
+        continue;
+      }
+      // worker finished
+      close(w->fd);
+      waitpid(w->pid, NULL, 0);
+      w->buf[w->len] = 0;
+      memset(&r, 0, sizeof(r));
+      if (w->len > (int)sizeof(r))
+        memcpy(&r, w->buf, sizeof(r));
+      else
+        strcpy(w->buf + sizeof(r), "worker failed");
+      printf("%s: %s\n", entries[w->entry].path, w->buf + sizeof(r));
+      if (journal) {
+        fleet_plan(op, &entries[w->entry], plan, sizeof(plan));
+        journal_add(journal, entries[w->entry].path, plan, &r, w->buf + sizeof(r));
+      }
+      total[0] += r.bytes;
+      total[1] += r.ios;
+      budget_charge(&budgets[0], r.bytes - w->estimate[0]);
+      budget_charge(&budgets[1], r.ios - w->estimate[1]);
+      hosts[w->host].running--;
+      if (!r.ok)
+        failed++;
+      done++;
+      w->pid = 0;
+    }
+  }
+  printf("%s: %i files on %i hosts, %i failed, %.1f MB and %lli I/O operations in %.1f s\n",
+         fleetopnames[op], done, num_hosts, failed, total[0] / (1024.0 * 1024.0),
+         (long long)total[1], (time_us() - start) / 1e6);
+  if (skipped)
+    printf("%s: skipped %i files already done according to journal\n", fleetopnames[op], skipped);
+  if (journal)
+    fclose(journal);
+  for (i = 0; i < num_hosts; i++) {
+    free(hosts[i].name);
+    free(hosts[i].queue);
+  }
+  for (i = 0; i < num_entries; i++)
+    free(entries[i].path);
+  free(hosts);
+  free(entries);
+  free(workers);
+  free(pfds);
+  free(slots);
+  return failed || done < num_entries;
+}
+#endif
+
+int main(int argc, char *argv[]) {
+  int binary_best_pos;
+  int binary_best_count;
+  uint8_t matches[CACHE_MATCH_BYTES];
+  int cached;
+  int cache_changed;
+  int racy = 0;
+  int64_t mtime;
+  char cache_key_before[CACHE_KEY_SIZE] = "";
+  struct resopts resolutions[NUM_RES];
+  uint8_t buffer[BUFFER_SZ];
+  struct exefile *xwa = NULL;
+  int is_xwa;
+  int i;
+  int res = 1;
+  enum PATCHES p;
+  const struct binary *binary;
+  const char *prog = argc > 0 ? argv[0] : "xwahacker";
+  struct stats statistics;
+  int print_statistics = 0;
+  int64_t phase_start;
+
+  memset(&statistics, 0, sizeof(statistics));
+  while (argc >= 2 && argv[1][0] == '-' && argv[1][1] == '-') {
+    if (strcmp(argv[1], "--stats") == 0) {
+      print_statistics = 1;
+    } else if (argc >= 3 && strcmp(argv[1], "--trace") == 0) {
+      statistics.trace = argv[2];
+      argc--;
+      argv++;
+    } else if (argc >= 3 && strcmp(argv[1], "--db") == 0) {
+      if (!patchdb_open(argv[2]))
+        return 1;
+      // not a statistics option
+      argc -= 2;
+      argv += 2;
+      continue;
+    } else {
+      break;
+    }
+    stats = &statistics;
+    argc--;
+    argv++;
+  }
+
+  if (argc < 2) {
+    print_help(prog);
+    return 1;
+  }
+
+  if (strcmp(argv[1], "--db-compile") == 0) {
+    if (argc == 4)
+      return compile_patchdb(argv[2], argv[3]);
+    print_help(prog);
+    return 1;
+  }
+
+  if (strcmp(argv[1], "--fingerprint") == 0) {
+    if (argc == 3)
+      return print_fingerprint(argv[2]);
+    print_help(prog);
+    return 1;
+  }
+
+  if (strcmp(argv[1], "--fleet") == 0) {
+#ifdef __linux__
+    int ret = fleet_main(argc - 2, argv + 2);
+    if (ret >= 0)
+      return ret;
+#else
+    printf("--fleet is only supported on Linux\n");
+    return 1;
+#endif
+    print_help(prog);
+    return 1;
+  }
+
+  if (strcmp(argv[1], "--watch") == 0) {
+#ifdef __linux__
+    if (argc == 3)
+      return watch_main(argv[2]);
+#else
+    printf("--watch is only supported on Linux\n");
+    return 1;
+#endif
+    print_help(prog);
+    return 1;
+  }
+
+  phase_start = trace_start();
+  xwa = exefile_open(argv[1], 1);
+  if (!xwa) {
+    printf("Could not open file %s: %s\n", argv[1], strerror(errno));
+    return 1;
+  }
+  // the cache only knows the built-in binaries
+  cached = patchdb ? 0 : cache_lookup(argv[1], cache_key_before, &binary_best_pos, &binary_best_count,
+                                      matches, &racy);
+  if (cached && racy) {
+    uint8_t current[CACHE_MATCH_BYTES];
+    prefetch_all(xwa);
+    patch_matches(buffer, xwa, current);
+    cached = memcmp(current, matches, sizeof(current)) == 0;
+  } else if (cached) {
+    prefetch_binary(xwa, &binaries[binary_best_pos]);
+  }
+  if (cached) {
+    binary = &binaries[binary_best_pos];
+  } else {
+    prefetch_all(xwa);
+    binary = detect_file(buffer, xwa, &binary_best_count);
+  }
+  if (binary == &ext_binary)
+    printf("Detected file as %s from patch database version %u with %i matches (of %i)\n",
+           binary->name, patchdb_version, binary_best_count, num_patchgroups(binary->patchgroups));
+  else if (binary_best_count > 0)
+    printf("Detected file as %s with %i matches (of %i)\n",
+           binary->name, binary_best_count, num_patchgroups(binary->patchgroups));
+  else
+    printf("Could not detect file, assuming it is %s\n", binary->name);
+  is_xwa = binary == &binaries[0];
+
+  read_res(buffer, xwa, resolutions);
+  phase_end(PHASE_DETECTION, phase_start);
+  phase_start = trace_start();
+
+  if (argc >= 3) {
+    const char *opt = argv[2];
+    if (argc == 3 && strcmp(opt, "-l") == 0) {
+      list_patches(binary->patchgroups);
+      res = 0;
+      goto cleanup;
+    } else if (argc == 3 && strcmp(opt, "-c") == 0 && binary->collections) {
+      list_collections(binary->collections);
+      res = 0;
+      goto cleanup;
+    } else if (argc == 3 && strcmp(opt, "-m") == 0) {
       list_metapatches();
       res = 0;
       goto cleanup;
@@ -1198,6 +3727,60 @@ int main(int argc, char *argv[]) {
         printf("Invalid new max FPS limit value\n");
       else if (!set_max_fps(buffer, xwa, fps))
         printf("Failed setting new max FPS limit value\n");
+      else
+        res = 0;
+      goto cleanup;
+    } else if (argc == 3 && strcmp(opt, "-v") == 0 && is_xwa) {
+      uint32_t values[NUM_PARAMS];
+      int valid[NUM_PARAMS];
+      read_params(buffer, xwa, values, valid);
+      printf("number : value : description\n");
+      for (i = 0; i < NUM_PARAMS; i++) {
+        const struct paramdesc *pd = &paramdescs[i];
+        union { uint32_t i; float f; } orig, val;
+        orig.i = pd->original;
+        val.i = values[i];
+        if (!valid[i])
+          printf("%4i : %10s : %s\n", i, "unknown", pd->name);
+        else if (pd->type == PARAM_F32)
+          printf("%4i : %10f : %s%s\n", i, val.f, pd->name, val.i == orig.i ? " (unmodified original)" : "");
+        else
+          printf("%4i : %10u : %s%s\n", i, val.i, pd->name, val.i == orig.i ? " (unmodified original)" : "");
+      }
+      res = 0;
+      goto cleanup;
+    } else if (argc == 5 && strcmp(opt, "-v") == 0 && is_xwa) {
+      int num = parse_num(argv[3], NUM_PARAMS);
+      union { uint32_t i; float f; } val;
+      uint32_t old;
+      if (num < 0) {
+        printf("Incorrect parameter number\n");
+        goto cleanup;
+      }
+      if (paramdescs[num].type == PARAM_F32) {
+        val.f = parse_float(argv[4], 0.01, 1000);
+        if (val.f < 0) {
+          printf("Incorrect parameter value\n");
+          goto cleanup;
+        }
+      } else {
+        int v = parse_num(argv[4], paramdescs[num].type == PARAM_U8 ? 256 : 100000);
+        if (v < 0) {
+          printf("Incorrect parameter value\n");
+          goto cleanup;
+        }
+        val.i = v;
+      }
+      if (!read_param(buffer, xwa, num, &old)) {
+        printf("Could not find %s in file\n", paramdescs[num].name);
+        goto cleanup;
+      }
+      if (!write_param(buffer, xwa, num, val.i)) {
+        printf("Failed setting %s\n", paramdescs[num].name);
+        goto cleanup;
+      }
+      printf("Changed %s\n", paramdescs[num].name);
+      res = 0;
       goto cleanup;
     } else if (argc == 3 && strcmp(opt, "-r") == 0 && is_xwa) {
       printf("Resolutions:\n");
@@ -1239,7 +3822,7 @@ int main(int argc, char *argv[]) {
       res = 0;
       goto cleanup;
     } else if (argc == 4 && strcmp(opt, "-p") == 0) {
-      int num = parse_num(argv[3], NUM_PATCHES);
+      int num = parse_num(argv[3], NUM_PATCHES + ext_num_patches);
       if (num < 0) {
         printf("Incorrect patch number\n");
         goto cleanup;
@@ -1249,6 +3832,16 @@ int main(int argc, char *argv[]) {
       else
         res = 0;
       goto cleanup;
+    } else if (argc == 4 && strcmp(opt, "-e") == 0) {
+      if (export_delta(buffer, xwa, binary, is_xwa, argv[3]))
+        res = 0;
+      goto cleanup;
+    } else if (argc == 4 && strcmp(opt, "-i") == 0) {
+      if (import_delta(buffer, xwa, binary, is_xwa, argv[3]))
+        res = 0;
+      else
+        printf("Patching failed\n");
+      goto cleanup;
     } else if (argc == 4 && strcmp(opt, "-c") == 0 && binary->collections) {
       int num = parse_num(argv[3], num_collections(binary->collections));
       if (num < 0) {
@@ -1278,13 +3871,11 @@ int main(int argc, char *argv[]) {
     }
   }
 
-  for (p = FIRST_PATCH; p < NUM_PATCHES; p++)
-    detected_patches[p] = check_patch(buffer, xwa, p, 1);
   printf("Detected patches:\n");
-  for (p = FIRST_PATCH; p < NUM_PATCHES; p++) {
-    if (detected_patches[p]) {
-      printf("%s", patchnames[p]);
-      if (patchdescs[p].original) printf(" (i.e. unmodified)");
+  for (p = FIRST_PATCH; p < NUM_PATCHES + ext_num_patches; p++) {
+    if (cached ? p < NUM_PATCHES && matches[p >> 3] & 1 << (p & 7) : check_patch(buffer, xwa, p, 1)) {
+      printf("%s", get_patchname(p));
+      if (get_patchdesc(p)->original) printf(" (i.e. unmodified)");
       printf("\n");
     }
   }
@@ -1292,7 +3883,37 @@ int main(int argc, char *argv[]) {
   res = 0;
 
 cleanup:
-  fclose(xwa);
+  phase_end(PHASE_PLANNING, phase_start);
+  phase_start = trace_start();
+  // do not leave e.g. half a collection applied
+  if (res)
+    exefile_discard(xwa);
+  // the cached matches stay valid unless something was written
+  cache_changed = !res && !patchdb && binary_best_count > 0 && (!cached || xwa->modified);
+  if (cache_changed) {
+    patch_matches(buffer, xwa, matches);
+    binary_best_pos = binary - binaries;
+  }
+  if (!exefile_close(xwa)) {
+    printf("Writing changes to file failed\n");
+    // the file is in an unknown state now
+    cache_update(argv[1], -1, 0, NULL);
+    res = 1;
+  } else if (!res && !patchdb && binary_best_count > 0) {
+    char key[CACHE_KEY_SIZE];
+    // own writes change the modification time, so the entry needs updating,
+    // a racy entry is stored again so that later runs can trust it
+    if (cache_changed || racy || !cache_key(argv[1], key, &mtime) || strcmp(key, cache_key_before))
+      cache_update(argv[1], binary_best_pos, binary_best_count, matches);
+  }
+  phase_end(PHASE_COMMIT, phase_start);
+  if (print_statistics)
+    print_stats();
+  if (statistics.trace && !write_trace(statistics.trace)) {
+    printf("Could not write trace file %s\n", statistics.trace);
+    res = 1;
+  }
+  free(statistics.events);
   return res;
 }
 #endif
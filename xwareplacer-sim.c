@@ -0,0 +1,310 @@
+/*
+ * Simulates X-Wing Alliance writing temp.tie to benchmark xwareplacer.
+ * Copyright (C) 2026 Reimar Döffinger
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#define NO_MAIN 1
+#include "xwareplacer.c"
+
+#define SIM_DIR "sim-install"
+#define MISSION_SIZE 4096
+// give up on a replacement after this long
+#define TIMEOUT_US 500000
+// time for xwareplacer to stage the next mission between game writes
+#define SETTLE_US 20000
+#define MAX_DELAYS 16
+
+/*
+ * How the simulated game writes temp.tie.
+ */
+enum PATTERN {
+  PATTERN_OVERWRITE = 0, ///< truncate and write in one go, like the game
+  PATTERN_CHUNKED,       ///< truncate and write in 4 parts, 1 ms apart
+  PATTERN_RENAME,        ///< write another file and rename it over temp.tie
+  NUM_PATTERNS
+};
+
+static const char * const pattern_names[NUM_PATTERNS] = {
+  [PATTERN_OVERWRITE] = "overwrite",
+  [PATTERN_CHUNKED]   = "chunked",
+  [PATTERN_RENAME]    = "rename",
+};
+
+/*
+ * Background load while measuring.
+ */
+enum LOAD {
+  LOAD_NONE = 0,
+  LOAD_CPU,   ///< one busy loop per CPU
+  LOAD_DISK,  ///< two processes writing and syncing files next to SKIRMISH
+  NUM_LOADS
+};
+
+static const char * const load_names[NUM_LOADS] = {
+  [LOAD_NONE] = "none",
+  [LOAD_CPU]  = "cpu",
+  [LOAD_DISK] = "disk",
+};
+
+static void sleep_us(long us) {
+  struct timespec ts;
+  ts.tv_sec = us / 1000000;
+  ts.tv_nsec = us % 1000000 * 1000;
+  nanosleep(&ts, NULL);
+}
+
+static int write_file(const char *name, const char *data, int len, int chunks) {
+  int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  int i;
+  int res = fd >= 0;
+  for (i = 0; res && i < chunks; i++) {
+    int start = len * i / chunks;
+    int end = len * (i + 1) / chunks;
+    if (i)
+      sleep_us(1000);
+    res = write(fd, data + start, end - start) == end - start;
+  }
+  if (fd >= 0 && close(fd))
+    res = 0;
+  return res;
+}
+
+/**
+ * Write temp.tie like the game does when starting a multiplayer mission.
+ * \return 0 on failure
+ */
+static int game_write(enum PATTERN pattern, const char *ref) {
+  switch (pattern) {
+  case PATTERN_CHUNKED:
+    return write_file(SIM_DIR "/" TEMP_TIE, ref, MISSION_SIZE, 4);
+  case PATTERN_RENAME:
+    return write_file(SIM_DIR "/" SKIRMISH_DIR "/game.tmp", ref, MISSION_SIZE, 1) &&
+           !rename(SIM_DIR "/" SKIRMISH_DIR "/game.tmp", SIM_DIR "/" TEMP_TIE);
+  default:
+    return write_file(SIM_DIR "/" TEMP_TIE, ref, MISSION_SIZE, 1);
+  }
+}
+
+/**
+ * \return 1 if temp.tie still is what the game wrote
+ */
+static int is_reference(void) {
+  char buf[sizeof(refstr)];
+  FILE *f = fopen(SIM_DIR "/" TEMP_TIE, "rb");
+  int res;
+  if (!f)
+    return 1;
+  res = fread(buf, 1, sizeof(buf), f) == sizeof(buf) &&
+        !memcmp(buf + refstr_skip, refstr[0] + refstr_skip, sizeof(refstr) - refstr_skip);
+  fclose(f);
+  return res;
+}
+
+/**
+ * Reading temp.tie back after a delay finds the replacement exactly if
+ * it was replaced within that delay, so the success rate for any delay
+ * follows from the time until the replacement is visible.
+ * \return time from the game closing temp.tie until it was replaced,
+ *         in microseconds, or -1 on timeout
+ */
+static int64_t wait_replaced(uint64_t start) {
+  while (is_reference()) {
+    if (now_us() - start > TIMEOUT_US)
+      return -1;
+    sleep_us(50);
+  }
+  return now_us() - start;
+}
+
+/// \return pid, -1 if the load could not be started
+static pid_t start_load(enum LOAD load, int n) {
+  pid_t pid = fork();
+  char name[64];
+  static char data[1 << 20];
+  if (pid < 0)
+    fprintf(stderr, "Could not start load process: %s\n", strerror(errno));
+  if (pid)
+    return pid;
+  if (load == LOAD_CPU)
+    for (;;) /* */;
+  snprintf(name, sizeof(name), SIM_DIR "/load-%i", n);
+  for (;;) {
+    int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    int i;
+    for (i = 0; fd >= 0 && i < 8; i++)
+      if (write(fd, data, sizeof(data))) /* */;
+    if (fd >= 0) {
+      fsync(fd);
+      close(fd);
+    }
+    unlink(name);
+  }
+}
+
+static void stop(pid_t pid) {
+  // kill(-1) would hit every process of the user
+  if (pid <= 0)
+    return;
+  kill(pid, SIGTERM);
+  waitpid(pid, NULL, 0);
+}
+
+/**
+ * Run xwareplacer headless in the simulated install.
+ * \return pid, -1 if it did not start
+ */
+static pid_t start_replacer(const char *bin, int poll) {
+  uint64_t start = now_us();
+  struct stat statbuf;
+  pid_t pid;
+  unlink(SIM_DIR "/ctl.sock");
+  pid = fork();
+  if (!pid) {
+    if (chdir(SIM_DIR) || !freopen("/dev/null", "w", stdout) || !freopen("/dev/null", "w", stderr))
+      _exit(1);
+    execl(bin, bin, "--control", "ctl.sock", poll ? "--poll" : "list.txt", poll ? "list.txt" : (char *)NULL, (char *)NULL);
+    _exit(1);
+  }
+  // the control socket is created once everything is set up
+  while (stat(SIM_DIR "/ctl.sock", &statbuf)) {
+    int exited = pid > 0 && waitpid(pid, NULL, WNOHANG) == pid;
+    if (pid < 0 || exited || now_us() - start > 5000000) {
+      fprintf(stderr, "Could not start %s\n", bin);
+      // do not leave it running in the background on timeout
+      if (pid > 0 && !exited)
+        stop(pid);
+      return -1;
+    }
+    sleep_us(1000);
+  }
+  return pid;
+}
+
+static void run(FILE *out, const char *bin, int poll, enum LOAD load, enum PATTERN pattern,
+                int iterations, const int *delays, int num_delays) {
+  static char ref[MISSION_SIZE];
+  struct latency_stats stats = {0};
+  int success[MAX_DELAYS] = {0};
+  int timeouts = 0;
+  pid_t loads[64];
+  int num_loads = 0;
+  pid_t replacer;
+  int i;
+  memcpy(ref, refstr, sizeof(refstr));
+  if (load == LOAD_CPU)
+    num_loads = sysconf(_SC_NPROCESSORS_ONLN);
+  else if (load == LOAD_DISK)
+    num_loads = 2;
+  if (num_loads > 64)
+    num_loads = 64;
+  for (i = 0; i < num_loads; i++) {
+    loads[i] = start_load(load, i);
+    if (loads[i] < 0)
+      break;
+  }
+  num_loads = i;
+  replacer = start_replacer(bin, poll);
+  for (i = 0; replacer > 0 && i < iterations; i++) {
+    uint64_t start;
+    int64_t latency;
+    int j;
+    if (!game_write(pattern, ref)) {
+      fprintf(stderr, "Could not write temp.tie\n");
+      break;
+    }
+    start = now_us();
+    latency = wait_replaced(start);
+    if (latency < 0)
+      timeouts++;
+    else
+      latency_add(&stats, latency);
+    for (j = 0; j < num_delays; j++)
+      success[j] += latency >= 0 && latency <= delays[j] * 1000;
+    sleep_us(SETTLE_US);
+  }
+  if (replacer > 0)
+    stop(replacer);
+  for (i = 0; i < num_loads; i++)
+    stop(loads[i]);
+  fprintf(out, "{\"backend\": \"%s\", \"load\": \"%s\", \"pattern\": \"%s\", \"iterations\": %i, \"timeouts\": %i",
+          poll ? "poll" : "inotify", load_names[load], pattern_names[pattern], iterations, timeouts);
+  if (stats.count)
+    fprintf(out, ", \"min_us\": %lu, \"p50_us\": %lu, \"p99_us\": %lu, \"max_us\": %lu",
+            (unsigned long)stats.min, (unsigned long)percentile(&stats, 50),
+            (unsigned long)percentile(&stats, 99), (unsigned long)stats.max);
+  for (i = 0; i < num_delays; i++)
+    fprintf(out, ", \"success_%ims\": %.4f", delays[i], (double)success[i] / iterations);
+  fprintf(out, "}\n");
+  fflush(out);
+}
+
+/**
+ * Create the simulated install with two missions to switch between.
+ * \return 0 on failure
+ */
+static int setup(void) {
+  char mission[MISSION_SIZE];
+  FILE *list;
+  int res;
+  mkdir(SIM_DIR, 0777);
+  mkdir(SIM_DIR "/" SKIRMISH_DIR, 0777);
+  memset(mission, 'A', sizeof(mission));
+  res = write_file(SIM_DIR "/mission1.tie", mission, sizeof(mission), 1);
+  memset(mission, 'B', sizeof(mission));
+  res = res && write_file(SIM_DIR "/mission2.tie", mission, sizeof(mission), 1);
+  list = fopen(SIM_DIR "/list.txt", "w");
+  if (!list || fputs("mission1.tie\nmission2.tie\n", list) < 0)
+    res = 0;
+  if (list && fclose(list))
+    res = 0;
+  return res;
+}
+
+int main(int argc, char *argv[]) {
+  char bin[PATH_MAX];
+  int iterations = argc > 2 ? atoi(argv[2]) : 100;
+  int delays[MAX_DELAYS] = {1, 5, 20};
+  int num_delays = 3;
+  int poll;
+  enum LOAD load;
+  enum PATTERN pattern;
+  if (argc < 2 || argc > 4 || iterations < 1 || !realpath(argv[1], bin)) {
+    fprintf(stderr, "Usage: %s <xwareplacer binary> [iterations] [read back delays in ms, e.g. 1,5,20]\n", argv[0]);
+    return 1;
+  }
+  if (argc > 3) {
+    const char *p = argv[3];
+    for (num_delays = 0; num_delays < MAX_DELAYS && *p; num_delays++) {
+      delays[num_delays] = atoi(p);
+      p += strcspn(p, ",");
+      p += *p == ',';
+    }
+  }
+  if (!setup()) {
+    fprintf(stderr, "Could not create simulated install in %s\n", SIM_DIR);
+    return 1;
+  }
+  for (poll = 0; poll < 2; poll++)
+    for (load = LOAD_NONE; load < NUM_LOADS; load = (enum LOAD)(load + 1))
+      for (pattern = PATTERN_OVERWRITE; pattern < NUM_PATTERNS; pattern = (enum PATTERN)(pattern + 1))
+        run(stdout, bin, poll, load, pattern, iterations, delays, num_delays);
+  return 0;
+}
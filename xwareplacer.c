@@ -16,11 +16,15 @@
  * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
  */
 
+#include <signal.h>
+#include <stdarg.h>
 #include <string.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 #ifdef _WIN32
 #include <conio.h>
@@ -29,8 +33,20 @@
 // replace both function and struct
 #define stat _stat
 #else
+#include <fcntl.h>
+#include <poll.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <termios.h>
 #endif
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+// check interval when temp.tie changes cannot be waited for
+#define POLL_MS 10
 
 static const int refstr_skip = 4;
 static const char refstr[23][10] = {
@@ -47,122 +63,746 @@ static const char refstr[23][10] = {
   "Region 1",
 };
 
-#define BLOCK_SIZE 2048
-static void copy(FILE *to, FILE *from) {
-  char buf[BLOCK_SIZE];
-  int got = 0;
-  do {
-    got = fread(buf, 1, BLOCK_SIZE, from);
-    if (got > 0)
-      got = fwrite(buf, 1, got, to);
-  } while (got == BLOCK_SIZE);
+#define SKIRMISH_DIR "SKIRMISH"
+#define TEMP_TIE SKIRMISH_DIR "/temp.tie"
+// next mission, written in advance so it can be renamed over temp.tie
+#define STAGED_TIE SKIRMISH_DIR "/temp.tie.next"
+
+/*
+ * Campaign pack: all missions of a list in one file, little-endian:
+ * "XWAPACK1", number of entries, then per entry offset of the
+ * 0-terminated name, offset and size of the data and CRC-32 of the data.
+ * Names and data follow the index.
+ */
+static const char pack_magic[8] = "XWAPACK1";
+#define PACK_HEADER_SIZE 12
+#define PACK_ENTRY_SIZE 16
+
+struct mission {
+  const char *name;
+  const char *data;
+  uint32_t size;
+  uint32_t crc;
+  int valid;  ///< 1 if data is verified, -1 if it is corrupted, 0 not checked yet
+  char *buf;  ///< allocation holding name and data, NULL if in pack mapping
+};
+
+struct campaign {
+  int num;
+  struct mission *missions;
+  void *map;  ///< mapping of the pack file, NULL for text lists
+  size_t map_size;
+};
+
+/**
+ * One game installation, with its own campaign and list position.
+ */
+struct install {
+  char *dir;        ///< NULL for the current directory
+  char *list;       ///< list or campaign pack, to reload it
+  char *skirmish;
+  char *temp_tie;
+  char *staged_tie;
+  struct campaign campaign;
+  int pos;
+  int staged;       ///< the mission at pos is in staged_tie
+  int changed;      ///< temp.tie needs to be checked
+  int wd;           ///< inotify watch, -1 if none
+};
+
+/**
+ * \return name relative to dir, to be freed by the caller
+ */
+static char *join_path(const char *dir, const char *name) {
+  char *res;
+  // absolute paths and Windows drive letters
+  if (!dir || name[0] == '/' || name[0] == '\\' || (name[0] && name[1] == ':'))
+    dir = NULL;
+  res = malloc((dir ? strlen(dir) + 1 : 0) + strlen(name) + 1);
+  sprintf(res, "%s%s%s", dir ? dir : "", dir ? "/" : "", name);
+  return res;
 }
 
-static int check_and_replace(const char *replace) {
-  struct stat statbuf;
+static uint32_t RL32(const char *p) {
+  const uint8_t *b = (const uint8_t *)p;
+  return b[0] | b[1] << 8 | b[2] << 16 | (uint32_t)b[3] << 24;
+}
+
+static void WL32(char *p, uint32_t v) {
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+}
+
+static uint32_t crc32(const char *data, uint32_t size) {
+  uint32_t crc = 0xffffffff;
+  uint32_t i;
+  int j;
+  for (i = 0; i < size; i++) {
+    crc ^= (uint8_t)data[i];
+    for (j = 0; j < 8; j++)
+      crc = crc >> 1 ^ (0xedb88320 & -(crc & 1));
+  }
+  return ~crc;
+}
+
+/**
+ * Pack missions are only checksummed when they are first used,
+ * so that startup does not depend on the campaign size.
+ * \return 1 if the mission data can be used
+ */
+static int mission_valid(struct mission *m) {
+  if (!m->valid) {
+    m->valid = crc32(m->data, m->size) == m->crc ? 1 : -1;
+    if (m->valid < 0)
+      fprintf(stderr, "Checksum mismatch for %s, campaign pack is corrupted\n", m->name);
+  }
+  return m->valid > 0;
+}
+
+/**
+ * Read a whole file into memory.
+ * \return 0 on failure
+ */
+static int load_mission(struct mission *m, const char *name, const char *path) {
+  FILE *f = fopen(path, "rb");
+  int namelen = strlen(name) + 1;
+  long size;
+  int res = 0;
+  if (!f || fseek(f, 0, SEEK_END) || (size = ftell(f)) < 0 || fseek(f, 0, SEEK_SET))
+    goto out;
+  m->buf = malloc(namelen + size);
+  if (!m->buf)
+    goto out;
+  memcpy(m->buf, name, namelen);
+  m->name = m->buf;
+  m->data = m->buf + namelen;
+  m->size = size;
+  m->valid = 1;
+  res = fread(m->buf + namelen, 1, size, f) == size;
+out:
+  if (f)
+    fclose(f);
+  return res;
+}
+
+/**
+ * Write the whole mission to a file, replacing its contents.
+ * \return 0 on failure
+ */
+static int write_mission(const char *name, const struct mission *m) {
+  FILE *f = fopen(name, "wb");
+  int res;
+  if (!f)
+    return 0;
+  // fwrite retries short writes, so either everything is written or it failed
+  res = fwrite(m->data, 1, m->size, f) == m->size;
+  if (fclose(f))
+    res = 0;
+  return res;
+}
+
+/**
+ * Prepare m for being renamed over temp.tie.
+ * \return 1 if staged, 0 if it has to be copied on replacement
+ */
+static int stage_mission(struct install *in) {
+  struct mission *m = &in->campaign.missions[in->pos];
+  in->staged = mission_valid(m) && write_mission(in->staged_tie, m);
+  return in->staged;
+}
+
+/**
+ * Atomically replace temp.tie by the staged file.
+ * \return 0 on failure, e.g. if the game still has temp.tie open on Windows
+ */
+static int replace_staged(const struct install *in) {
+#ifdef _WIN32
+  return MoveFileExA(in->staged_tie, in->temp_tie, MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+  return rename(in->staged_tie, in->temp_tie) == 0;
+#endif
+}
+
+/**
+ * \return monotonic time in microseconds
+ */
+static uint64_t now_us(void) {
+#ifdef _WIN32
+  LARGE_INTEGER freq, count;
+  QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&count);
+  return count.QuadPart / freq.QuadPart * 1000000 + count.QuadPart % freq.QuadPart * 1000000 / freq.QuadPart;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+#endif
+}
+
+/// timestamps of one replacement, from now_us()
+struct replace_event {
+  uint64_t seen;       ///< new temp.tie noticed
+  uint64_t validated;  ///< header matched refstr
+  uint64_t done;       ///< replacement finished
+  const char *method;  ///< "rename", "copy" or NULL if replacing failed
+};
+
+/**
+ * \return 1 if temp.tie was replaced, 0 if it was not the reference
+ * file, -1 if replacing it failed
+ */
+static int check_and_replace(struct install *in, struct replace_event *ev) {
+  struct mission *replace = &in->campaign.missions[in->pos];
   char buf[sizeof(refstr)] = {0};
   int res;
   FILE *file = NULL;
-  FILE *src_file = NULL;
 
   // check for auto-generated multi-location temp.tie
-  res = stat("SKIRMISH/temp.tie", &statbuf);
-  if (res != 0)
-    goto err_out;
-  file = fopen("SKIRMISH/temp.tie", "rb");
+  file = fopen(in->temp_tie, "rb");
   if (!file)
-    goto err_out;
+    return 0;
   res = fread(buf, 1, sizeof(buf), file);
+  fclose(file);
   if (res != sizeof(buf) || memcmp(buf + refstr_skip, refstr[0] + refstr_skip, sizeof(refstr) - refstr_skip))
-    goto err_out;
+    return 0;
+  ev->validated = now_us();
 
   // try to replace it
-  src_file = fopen(replace, "rb");
-  if (!src_file) {
-    fprintf(stderr, "Could not open reference file %s\n", replace);
-    goto err_out;
+  ev->method = NULL;
+  if (in->staged && replace_staged(in))
+    ev->method = "rename";
+  else if (mission_valid(replace) && write_mission(in->temp_tie, replace))
+    ev->method = "copy";
+  ev->done = now_us();
+  return ev->method ? 1 : -1;
+}
+
+/*
+ * Replacement latency, from noticing temp.tie to having replaced it,
+ * in microseconds. Buckets are log-linear as in HDR histograms: exact
+ * below 32, above that 16 buckets per power of two, so values are
+ * accurate to about 6%.
+ */
+#define HIST_SUB_BITS 4
+#define HIST_SIZE (64 << HIST_SUB_BITS)
+
+static struct latency_stats {
+  unsigned count;
+  uint64_t min;
+  uint64_t max;
+  uint64_t sum;
+  unsigned buckets[HIST_SIZE];
+} latency;
+
+static FILE *event_log;
+
+static int hist_index(uint64_t v) {
+  int shift = 0;
+  while (v >> shift >= 2 << HIST_SUB_BITS)
+    shift++;
+  return (shift << HIST_SUB_BITS) + (v >> shift);
+}
+
+/**
+ * \return highest value that falls into bucket i
+ */
+static uint64_t hist_value(int i) {
+  int shift = i < 2 << HIST_SUB_BITS ? 0 : (i >> HIST_SUB_BITS) - 1;
+  return ((uint64_t)(i - (shift << HIST_SUB_BITS)) << shift) + ((uint64_t)1 << shift) - 1;
+}
+
+static uint64_t percentile(const struct latency_stats *s, int p) {
+  uint64_t target = ((uint64_t)s->count * p + 99) / 100;
+  uint64_t seen = 0;
+  int i;
+  for (i = 0; i < HIST_SIZE; i++) {
+    seen += s->buckets[i];
+    if (seen >= target)
+      return hist_value(i) < s->max ? hist_value(i) : s->max;
   }
-  fclose(file);
-  file = fopen("SKIRMISH/temp.tie", "wb");
-  if (!file)
-    goto err_out;
-  copy(file, src_file);
-  return 1;
+  return s->max;
+}
 
-err_out:
-  if (file)
-    fclose(file);
-  if (src_file)
-    fclose(src_file);
-  return 0;
+static void print_latency(const struct latency_stats *s) {
+  if (!s->count) {
+    printf("No replacements\n");
+    return;
+  }
+  printf("%u replacements, latency in us: min %lu, median %lu, 90%% %lu, 99%% %lu, max %lu, mean %lu\n",
+         s->count, (unsigned long)s->min, (unsigned long)percentile(s, 50), (unsigned long)percentile(s, 90),
+         (unsigned long)percentile(s, 99), (unsigned long)s->max, (unsigned long)(s->sum / s->count));
 }
 
-#define MAX_ENTRIES 128
-#define MAX_LEN 128
+/// connection to the control socket
+struct client {
+  int fd;
+  int subscribed;  ///< receives all events
+  int broken;      ///< a line could not be sent completely, to be dropped
+  int len;
+  char buf[256];   ///< incomplete command
+};
 
-typedef char NameEntry[MAX_LEN];
+static int control_fd = -1;
+static struct client *clients;
+static int num_clients;
 
-static NameEntry *read_list(const char *fname) {
-  static const char whitespace[] = " \r\n";
+#ifndef _WIN32
+/**
+ * Send a complete line to a client.
+ * The socket does not block, so a too slow client might only get part of
+ * it. Anything sent after that would corrupt its stream, so it is
+ * disconnected instead. It is only dropped later by wait_event, since
+ * this might run while the clients are being processed.
+ */
+static void client_write(struct client *c, const char *line, int len) {
+  if (c->broken || write(c->fd, line, len) == len)
+    return;
+  fprintf(stderr, "Control client too slow or gone, disconnecting it\n");
+  shutdown(c->fd, SHUT_RDWR);
+  c->broken = 1;
+}
+#endif
+
+/**
+ * Send a line to all clients that subscribed to events.
+ */
+static void control_broadcast(const char *line, int len) {
+#ifndef _WIN32
   int i;
-  NameEntry *list = calloc(MAX_ENTRIES + 1, sizeof(*list));
-  FILE *list_file = NULL;
-  list_file = fopen(fname, "r");
+  // too slow clients are dropped instead of blocking replacements
+  for (i = 0; i < num_clients; i++)
+    if (clients[i].subscribed)
+      client_write(&clients[i], line, len);
+#endif
+}
+
+/**
+ * \return str as quoted JSON string, to be freed by the caller
+ */
+static char *json_string(const char *str) {
+  char *res = malloc(6 * strlen(str) + 3);
+  char *p = res;
+  *p++ = '"';
+  for (; *str; str++) {
+    if (*str == '"' || *str == '\\')
+      *p++ = '\\';
+    if ((uint8_t)*str < 0x20)
+      p += sprintf(p, "\\u%04x", *str);
+    else
+      *p++ = *str;
+  }
+  *p++ = '"';
+  *p = 0;
+  return res;
+}
+
+/**
+ * Write one JSON line to the event log and to subscribed control clients.
+ */
+static void log_event(const char *type, const struct install *in, const struct replace_event *ev) {
+  char *dir;
+  char *name;
+  char *line;
+  int len;
+  if (!event_log && !num_clients)
+    return;
+  dir = json_string(in->dir ? in->dir : ".");
+  name = json_string(in->campaign.missions[in->pos].name);
+  line = malloc(256 + strlen(dir) + strlen(name));
+  len = sprintf(line, "{\"time\": %lu, \"event\": \"%s\", ", (unsigned long)time(NULL), type);
+  if (in->dir)
+    len += sprintf(line + len, "\"install\": %s, ", dir);
+  len += sprintf(line + len, "\"position\": %i, \"mission\": %s", in->pos, name);
+  if (ev)
+    len += sprintf(line + len, ", \"method\": \"%s\", \"validated_us\": %lu, \"replaced_us\": %lu",
+                   ev->method ? ev->method : "failed",
+                   (unsigned long)(ev->validated - ev->seen), (unsigned long)(ev->done - ev->seen));
+  len += sprintf(line + len, "}\n");
+  if (event_log) {
+    fputs(line, event_log);
+    fflush(event_log);
+  }
+  control_broadcast(line, len);
+  free(line);
+  free(name);
+  free(dir);
+}
+
+static void latency_add(struct latency_stats *s, uint64_t v) {
+  if (!s->count || v < s->min)
+    s->min = v;
+  if (v > s->max)
+    s->max = v;
+  s->sum += v;
+  s->count++;
+  s->buckets[hist_index(v)]++;
+}
+
+static void record_replace(const struct install *in, const struct replace_event *ev) {
+  log_event("replace", in, ev);
+  if (ev->method)
+    latency_add(&latency, ev->done - ev->seen);
+}
+
+/**
+ * Read a line of any length.
+ * \return line without trailing whitespace, NULL at end of file
+ */
+static char *read_line(FILE *f) {
+  static const char whitespace[] = " \r\n";
+  int size = 128;
+  int len = 0;
+  char *line = malloc(size);
+  while (line && fgets(line + len, size - len, f)) {
+    len += strlen(line + len);
+    if (len > 0 && line[len - 1] == '\n')
+      break;
+    size *= 2;
+    line = realloc(line, size);
+  }
+  if (line && !len) {
+    free(line);
+    line = NULL;
+  }
+  if (!line)
+    return NULL;
+  while (len > 0 && strchr(whitespace, line[len - 1]))
+    len--;
+  line[len] = 0;
+  return line;
+}
+
+/**
+ * Read the list and load all files in it, relative to dir.
+ * \return 0 on failure
+ */
+static int read_list(struct campaign *c, const char *fname, const char *dir) {
+  char *line;
+  char *path;
+  int allocated = 0;
+  FILE *list_file = fopen(fname, "r");
   if (!list_file) {
     fprintf(stderr, "Could not open list file %s\n", fname);
-    goto err_out;
+    return 0;
   }
-  for (i = 0; i < MAX_ENTRIES; i++) {
-    int len;
-    if (!fgets(list[i], sizeof(*list), list_file)) {
-      list[i][0] = 0;
-      break;
-    }
-    len = strlen(list[i]);
-    // remove trailing newline
-    while (len > 0 && strchr(whitespace, list[i][len - 1]))
-      len--;
-    list[i][len] = 0;
+  while ((line = read_line(list_file))) {
     // skip empty and comment lines
-    if (len == 0 || list[i][0] == '#') {
-      i--;
+    if (!line[0] || line[0] == '#') {
+      free(line);
       continue;
     }
+    if (c->num == allocated) {
+      allocated = 2 * allocated + 16;
+      c->missions = realloc(c->missions, allocated * sizeof(*c->missions));
+    }
+    memset(&c->missions[c->num], 0, sizeof(*c->missions));
+    c->num++;
+    path = join_path(dir, line);
+    if (!load_mission(&c->missions[c->num - 1], line, path)) {
+      fprintf(stderr, "Could not open file %i from list: %s\n", c->num - 1, path);
+      free(path);
+      free(line);
+      goto err_out;
+    }
+    free(path);
+    free(line);
   }
-  if (!list[0][0]) {
+  if (!c->num) {
     fprintf(stderr, "List file %s does not contain any files\n", fname);
     goto err_out;
   }
   fclose(list_file);
-  return list;
+  return 1;
+err_out:
+  fclose(list_file);
+  return 0;
+}
+
+/**
+ * Map a whole file read-only.
+ * \return mapping or NULL on failure
+ */
+static void *map_file(const char *fname, size_t *size) {
+  void *map = NULL;
+#ifdef _WIN32
+  HANDLE mapping = NULL;
+  HANDLE file = CreateFileA(fname, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+  if (file == INVALID_HANDLE_VALUE)
+    return NULL;
+  *size = GetFileSize(file, NULL);
+  if (*size != INVALID_FILE_SIZE && *size > 0)
+    mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+  if (mapping)
+    map = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+  // the view keeps the file open
+  if (mapping)
+    CloseHandle(mapping);
+  CloseHandle(file);
+#else
+  struct stat statbuf;
+  int fd = open(fname, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+  if (!fstat(fd, &statbuf) && statbuf.st_size > 0) {
+    *size = statbuf.st_size;
+    map = mmap(NULL, *size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+      map = NULL;
+  }
+  close(fd);
+#endif
+  return map;
+}
+
+static void unmap_file(void *map, size_t size) {
+#ifdef _WIN32
+  UnmapViewOfFile(map);
+#else
+  munmap(map, size);
+#endif
+}
+
+/**
+ * Use a campaign pack, only the index is read.
+ * \return 0 on failure
+ */
+static int read_pack(struct campaign *c, const char *fname) {
+  const char *pack;
+  uint32_t num;
+  uint32_t i;
+  c->map = map_file(fname, &c->map_size);
+  if (!c->map) {
+    fprintf(stderr, "Could not open campaign pack %s\n", fname);
+    return 0;
+  }
+  pack = c->map;
+  if (c->map_size < PACK_HEADER_SIZE)
+    goto err_out;
+  num = RL32(pack + sizeof(pack_magic));
+  if (num == 0 || num > (c->map_size - PACK_HEADER_SIZE) / PACK_ENTRY_SIZE)
+    goto err_out;
+  c->num = num;
+  c->missions = calloc(num, sizeof(*c->missions));
+  for (i = 0; i < num; i++) {
+    const char *entry = pack + PACK_HEADER_SIZE + i * PACK_ENTRY_SIZE;
+    struct mission *m = &c->missions[i];
+    uint32_t name = RL32(entry);
+    uint32_t data = RL32(entry + 4);
+    m->size = RL32(entry + 8);
+    m->crc = RL32(entry + 12);
+    if (name >= c->map_size || !memchr(pack + name, 0, c->map_size - name) ||
+        data > c->map_size || m->size > c->map_size - data)
+      goto err_out;
+    m->name = pack + name;
+    m->data = pack + data;
+  }
+  return 1;
 err_out:
-  free(list);
-  if (list_file)
-    fclose(list_file);
-  return NULL;
+  fprintf(stderr, "Campaign pack %s is corrupted\n", fname);
+  return 0;
+}
+
+/**
+ * Load a campaign from a campaign pack or a list of files, with
+ * paths in the list relative to dir.
+ * \return 0 on failure
+ */
+static int read_campaign(struct campaign *c, const char *fname, const char *dir) {
+  char magic[sizeof(pack_magic)] = {0};
+  FILE *f = fopen(fname, "rb");
+  if (f) {
+    if (fread(magic, 1, sizeof(magic), f)) /* */;
+    fclose(f);
+  }
+  if (!memcmp(magic, pack_magic, sizeof(magic)))
+    return read_pack(c, fname);
+  return read_list(c, fname, dir);
 }
 
-static void print_list(NameEntry *list, int pos) {
+static void free_campaign(struct campaign *c) {
+  int i;
+  for (i = 0; i < c->num; i++)
+    free(c->missions[i].buf);
+  free(c->missions);
+  if (c->map)
+    unmap_file(c->map, c->map_size);
+}
+
+/**
+ * Build a campaign pack from a list file.
+ * \return 0 on failure
+ */
+static int write_pack(const char *list_fname, const char *pack_fname) {
+  struct campaign c = {0};
+  FILE *f = NULL;
+  char *index = NULL;
+  uint32_t pos;
+  int index_size;
+  int res = 0;
+  int i;
+  if (!read_list(&c, list_fname, NULL))
+    goto out;
+  index_size = PACK_HEADER_SIZE + c.num * PACK_ENTRY_SIZE;
+  index = malloc(index_size);
+  memcpy(index, pack_magic, sizeof(pack_magic));
+  WL32(index + sizeof(pack_magic), c.num);
+  pos = index_size;
+  for (i = 0; i < c.num; i++) {
+    WL32(index + PACK_HEADER_SIZE + i * PACK_ENTRY_SIZE, pos);
+    pos += strlen(c.missions[i].name) + 1;
+  }
+  for (i = 0; i < c.num; i++) {
+    char *entry = index + PACK_HEADER_SIZE + i * PACK_ENTRY_SIZE;
+    WL32(entry + 4, pos);
+    WL32(entry + 8, c.missions[i].size);
+    WL32(entry + 12, crc32(c.missions[i].data, c.missions[i].size));
+    pos += c.missions[i].size;
+  }
+  f = fopen(pack_fname, "wb");
+  if (!f)
+    goto out;
+  res = fwrite(index, 1, index_size, f) == index_size;
+  for (i = 0; res && i < c.num; i++)
+    res = fputs(c.missions[i].name, f) >= 0 && putc(0, f) == 0;
+  for (i = 0; res && i < c.num; i++)
+    res = fwrite(c.missions[i].data, 1, c.missions[i].size, f) == c.missions[i].size;
+  if (fclose(f))
+    res = 0;
+out:
+  if (!res)
+    fprintf(stderr, "Could not write campaign pack %s\n", pack_fname);
+  else
+    printf("Wrote %i missions to %s\n", c.num, pack_fname);
+  free(index);
+  free_campaign(&c);
+  return res;
+}
+
+static void print_list(const struct install *in) {
   int i;
   printf("\nNew position:\n");
-  for (i = 0; list[i][0]; i++) {
-    printf(i == pos ? "--> " : "    ");
-    printf("%s", list[i]);
-    printf(i == pos ? " <--" : "    ");
+  for (i = 0; i < in->campaign.num; i++) {
+    printf(i == in->pos ? "--> " : "    ");
+    printf("%s", in->campaign.missions[i].name);
+    printf(i == in->pos ? " <--" : "    ");
     printf("\n");
   }
   printf("Press 's' to move to next entry, 'w' to previous, 'q' to exit\n");
 }
 
-static void move_list(NameEntry *list, int *pos, int dir) {
+static void set_position(struct install *in, int pos) {
+  in->pos = pos;
+  stage_mission(in);
+}
+
+static void move_list(struct install *in, int dir) {
   // dir is only allowed to be 1 or -1
-  *pos += dir;
-  if (*pos < 0) {
-    int i = 0;
-    while (list[i][0]) i++;
-    *pos = i - 1;
-  } else if (!list[*pos][0])
-    *pos = 0;
+  int pos = in->pos + dir;
+  if (pos < 0)
+    pos = in->campaign.num - 1;
+  else if (pos >= in->campaign.num)
+    pos = 0;
+  set_position(in, pos);
+}
+
+/**
+ * Load the campaign for the game installed in dir.
+ * \param dir NULL for the current directory
+ * \param list list or campaign pack, relative to dir
+ * \return 0 on failure
+ */
+static int install_init(struct install *in, const char *dir, const char *list) {
+  struct stat statbuf;
+  int res;
+  memset(in, 0, sizeof(*in));
+  in->wd = -1;
+  in->dir = dir ? strdup(dir) : NULL;
+  in->skirmish = join_path(dir, SKIRMISH_DIR);
+  in->temp_tie = join_path(dir, TEMP_TIE);
+  in->staged_tie = join_path(dir, STAGED_TIE);
+  in->changed = 1;
+  if (stat(in->skirmish, &statbuf) != 0) {
+    fprintf(stderr, "Could not find %s directory, started at wrong location?\n", in->skirmish);
+    return 0;
+  }
+  in->list = join_path(dir, list);
+  res = read_campaign(&in->campaign, in->list, dir);
+  if (res)
+    stage_mission(in);
+  return res;
+}
+
+/**
+ * Read the list or campaign pack again, keeping the position if possible.
+ * \return 0 on failure, the old campaign is kept then
+ */
+static int install_reload(struct install *in) {
+  struct campaign c = {0};
+  if (!read_campaign(&c, in->list, in->dir)) {
+    free_campaign(&c);
+    return 0;
+  }
+  free_campaign(&in->campaign);
+  in->campaign = c;
+  set_position(in, in->pos < c.num ? in->pos : 0);
+  return 1;
+}
+
+static void install_free(struct install *in) {
+  remove(in->staged_tie);
+  free_campaign(&in->campaign);
+  free(in->dir);
+  free(in->list);
+  free(in->skirmish);
+  free(in->temp_tie);
+  free(in->staged_tie);
+}
+
+/**
+ * Read the supervisor configuration: one game directory per line,
+ * optionally followed by a tab and the list or campaign pack to use
+ * for it instead of xwareplacer-list.txt.
+ * \return number of installs, 0 on failure
+ */
+static int read_installs(struct install **installs, const char *fname) {
+  char *line;
+  int num = 0;
+  int allocated = 0;
+  FILE *f = fopen(fname, "r");
+  if (!f) {
+    fprintf(stderr, "Could not open install list %s\n", fname);
+    return 0;
+  }
+  while ((line = read_line(f))) {
+    char *list = strchr(line, '\t');
+    int ok;
+    if (!line[0] || line[0] == '#') {
+      free(line);
+      continue;
+    }
+    if (list)
+      *list++ = 0;
+    if (num == allocated) {
+      allocated = 2 * allocated + 16;
+      *installs = realloc(*installs, allocated * sizeof(**installs));
+    }
+    ok = install_init(&(*installs)[num], line, list ? list : "xwareplacer-list.txt");
+    num++;
+    free(line);
+    if (!ok)
+      goto err_out;
+  }
+  fclose(f);
+  if (!num)
+    fprintf(stderr, "Install list %s does not contain any directories\n", fname);
+  return num;
+err_out:
+  fclose(f);
+  while (num--)
+    install_free(&(*installs)[num]);
+  return 0;
 }
 
 #ifdef _WIN32
@@ -199,56 +839,383 @@ static int get_char_noblock(void) {
 #endif
 }
 
+#ifndef _WIN32
+/**
+ * Listen for control clients on a local socket.
+ * \return 0 on failure
+ */
+static int control_init(const char *path) {
+  struct sockaddr_un addr;
+  struct stat statbuf;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Control socket path %s is too long\n", path);
+    return 0;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  // remove a stale socket of an earlier run, but never other files
+  if (!stat(path, &statbuf) && S_ISSOCK(statbuf.st_mode))
+    unlink(path);
+  control_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (control_fd < 0 || bind(control_fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(control_fd, 8)) {
+    fprintf(stderr, "Could not create control socket %s\n", path);
+    if (control_fd >= 0)
+      close(control_fd);
+    control_fd = -1;
+    return 0;
+  }
+  fcntl(control_fd, F_SETFD, FD_CLOEXEC);
+  return 1;
+}
+
+static void control_accept(void) {
+  int fd = accept(control_fd, NULL, NULL);
+  if (fd < 0)
+    return;
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+  fcntl(fd, F_SETFL, O_NONBLOCK);
+  clients = realloc(clients, (num_clients + 1) * sizeof(*clients));
+  memset(&clients[num_clients], 0, sizeof(*clients));
+  clients[num_clients++].fd = fd;
+}
+
+static void control_drop(int i) {
+  close(clients[i].fd);
+  clients[i] = clients[--num_clients];
+}
+
+static void client_reply(struct client *c, const char *fmt, ...) {
+  char buf[1024];
+  int len;
+  va_list va;
+  va_start(va, fmt);
+  len = vsnprintf(buf, sizeof(buf) - 1, fmt, va);
+  va_end(va);
+  if (len < 0 || len > (int)sizeof(buf) - 2)
+    len = sizeof(buf) - 2;
+  buf[len++] = '\n';
+  client_write(c, buf, len);
+}
+
+/**
+ * Run one command of a control client, commands are
+ * "installs", "status [install]", "next [install]", "prev [install]",
+ * "goto <install> <position>", "reload [install]" and "subscribe".
+ * Installs are numbered from 0 in the order of the install list.
+ */
+static void client_command(struct client *c, const char *line, struct install *installs, int num) {
+  char cmd[16];
+  int idx = 0;
+  int pos = -1;
+  int n = sscanf(line, "%15s %i %i", cmd, &idx, &pos);
+  struct install *in;
+  if (n < 1)
+    return;
+  if (!strcmp(cmd, "subscribe")) {
+    c->subscribed = 1;
+    client_reply(c, "ok");
+    return;
+  }
+  if (!strcmp(cmd, "installs")) {
+    client_reply(c, "ok %i", num);
+    return;
+  }
+  if (idx < 0 || idx >= num) {
+    client_reply(c, "error no install %i", idx);
+    return;
+  }
+  in = &installs[idx];
+  if (!strcmp(cmd, "next") || !strcmp(cmd, "prev")) {
+    move_list(in, cmd[0] == 'n' ? 1 : -1);
+    log_event("move", in, NULL);
+  } else if (!strcmp(cmd, "goto") && pos >= 0 && pos < in->campaign.num) {
+    set_position(in, pos);
+    log_event("move", in, NULL);
+  } else if (!strcmp(cmd, "reload")) {
+    if (!install_reload(in)) {
+      client_reply(c, "error could not load %s", in->list);
+      return;
+    }
+    log_event("reload", in, NULL);
+  } else if (strcmp(cmd, "status")) {
+    client_reply(c, "error invalid command");
+    return;
+  }
+  client_reply(c, "ok %i %i %s", in->pos, in->campaign.num, in->campaign.missions[in->pos].name);
+}
+
+/**
+ * Read and run the commands a client sent.
+ * \return 0 if the client has to be dropped
+ */
+static int client_read(struct client *c, struct install *installs, int num) {
+  int len = read(c->fd, c->buf + c->len, sizeof(c->buf) - 1 - c->len);
+  char *end;
+  if (len <= 0)
+    return 0;
+  c->len += len;
+  c->buf[c->len] = 0;
+  while ((end = strchr(c->buf, '\n'))) {
+    *end++ = 0;
+    client_command(c, c->buf, installs, num);
+    c->len -= end - c->buf;
+    memmove(c->buf, end, c->len + 1);
+  }
+  // a line that does not fit is no valid command
+  return c->len < (int)sizeof(c->buf) - 1;
+}
+#endif
+
+/**
+ * Set up waiting for writes to temp.tie of all installs, with a single
+ * inotify instance for all of them.
+ * \return file descriptor to wait on, -1 if only polling is possible
+ */
+static int notify_init(struct install *installs, int num) {
+#ifdef __linux__
+  int i;
+  int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  for (i = 0; fd >= 0 && i < num; i++) {
+    installs[i].wd = inotify_add_watch(fd, installs[i].skirmish, IN_CLOSE_WRITE | IN_MOVED_TO);
+    if (installs[i].wd < 0) {
+      close(fd);
+      fd = -1;
+    }
+  }
+  if (fd >= 0)
+    return fd;
+  fprintf(stderr, "inotify not available, checking for temp.tie every %i ms\n", POLL_MS);
+#endif
+  return -1;
+}
+
+/**
+ * Read all pending events and mark the installs whose temp.tie changed.
+ */
+static void notify_drain(int fd, struct install *installs, int num) {
+#ifdef __linux__
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  int len;
+  int i;
+  while ((len = read(fd, buf, sizeof(buf))) > 0) {
+    char *p;
+    for (p = buf; p < buf + len; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len) {
+      const struct inotify_event *ev = (const struct inotify_event *)p;
+      // the game might use any case, as usual on Windows
+      int temp_tie = ev->len && !strcasecmp(ev->name, "temp.tie");
+      for (i = 0; i < num; i++)
+        if ((ev->mask & IN_Q_OVERFLOW) || (temp_tie && ev->wd == installs[i].wd))
+          installs[i].changed = 1;
+    }
+  }
+#endif
+}
+
+/**
+ * Wait until a key is pressed or temp.tie of an install might have changed,
+ * setting their changed flag. Control clients are handled meanwhile.
+ * Without notification support this returns after POLL_MS and marks
+ * all installs as changed.
+ * \param input 0 to ignore the keyboard
+ * \return key pressed or -1
+ */
+static int wait_event(int notify_fd, int input, struct install *installs, int num) {
+  int i;
+#ifdef _WIN32
+  usleep(POLL_MS * 1000);
+  for (i = 0; i < num; i++)
+    installs[i].changed = 1;
+  return input ? get_char_noblock() : -1;
+#else
+  static int input_closed;
+  static struct pollfd *fds;
+  int polled_clients;
+  int key = -1;
+  for (i = num_clients - 1; i >= 0; i--)
+    if (clients[i].broken)
+      control_drop(i);
+  polled_clients = num_clients;
+  fds = realloc(fds, (3 + num_clients) * sizeof(*fds));
+  fds[0].fd = input_closed || !input ? -1 : 0;
+  fds[1].fd = notify_fd;
+  fds[2].fd = control_fd;
+  for (i = 0; i < num_clients; i++)
+    fds[3 + i].fd = clients[i].fd;
+  for (i = 0; i < 3 + num_clients; i++)
+    fds[i].events = POLLIN;
+  for (i = 0; notify_fd < 0 && i < num; i++)
+    installs[i].changed = 1;
+  if (poll(fds, 3 + num_clients, notify_fd < 0 ? POLL_MS : -1) <= 0)
+    return -1;
+  if (fds[1].revents)
+    notify_drain(notify_fd, installs, num);
+  if (fds[2].revents)
+    control_accept();
+  // backwards, so dropping a client does not move the unprocessed ones
+  for (i = polled_clients - 1; i >= 0; i--)
+    if (fds[3 + i].revents && !client_read(&clients[i], installs, num))
+      control_drop(i);
+  if (fds[0].revents) {
+    key = get_char_noblock();
+    // no more input, only wait for temp.tie from now on
+    if (key < 0)
+      input_closed = 1;
+  }
+  return key;
+#endif
+}
+
+static volatile sig_atomic_t quit;
+
+static void quit_handler(int sig) {
+  quit = 1;
+}
+
+#ifndef NO_MAIN
 int main(int argc, char *argv[]) {
   int i;
-  int list_pos = 0;
-  const char *list_fname = argc == 2 ? argv[1] : "xwareplacer-list.txt";
-  NameEntry *list = NULL;
-  struct stat statbuf;
-  if (stat("SKIRMISH", &statbuf) != 0) {
-    fprintf(stderr, "Could not find SKIRMISH directory, started at wrong location?\n");
+  int num = 0;
+  int notify_fd;
+  uint64_t seen;
+  const char *list_fname = "xwareplacer-list.txt";
+  const char *installs_fname = NULL;
+  const char *control_path = NULL;
+  int force_poll = 0;
+  struct install *installs = NULL;
+  for (i = 1; i < argc && !strncmp(argv[i], "--", 2); i++) {
+    if (!strcmp(argv[i], "--pack") && i + 2 < argc)
+      return !write_pack(argv[i + 1], argv[i + 2]);
+    if (!strcmp(argv[i], "--log") && i + 1 < argc) {
+      event_log = fopen(argv[++i], "a");
+      if (!event_log) {
+        fprintf(stderr, "Could not open event log %s\n", argv[i]);
+        goto err_out;
+      }
+      continue;
+    }
+    if (!strcmp(argv[i], "--poll")) {
+      force_poll = 1;
+      continue;
+    }
+    if (!strcmp(argv[i], "--installs") && i + 1 < argc) {
+      installs_fname = argv[++i];
+      continue;
+    }
+#ifndef _WIN32
+    if (!strcmp(argv[i], "--control") && i + 1 < argc) {
+      control_path = argv[++i];
+      continue;
+    }
+#endif
+    break;
+  }
+  if (i < argc && !installs_fname)
+    list_fname = argv[i++];
+  if (i < argc) {
+    fprintf(stderr, "Usage: %s [--log <events file>] [--control <socket>] [--poll] [list or campaign pack]\n"
+                    "       %s [--log <events file>] [--control <socket>] [--poll] --installs <install list>\n"
+                    "       %s --pack <list> <campaign pack>\n", argv[0], argv[0], argv[0]);
     goto err_out;
   }
-  list = read_list(list_fname);
-  if (!list)
-    return 1;
-  for (i = 0; list[i][0]; i++) {
-    FILE *test = fopen(list[i], "rb");
-    if (!test) {
-      fprintf(stderr, "Could not open file %i from list: %s\n", i, list[i]);
-      goto err_out;
-    }
-    fclose(test);
+  if (installs_fname) {
+    num = read_installs(&installs, installs_fname);
+  } else {
+    installs = calloc(1, sizeof(*installs));
+    num = install_init(installs, NULL, list_fname);
+    if (!num)
+      install_free(installs);
   }
-  print_list(list, list_pos);
-  noblock_init();
-  do {
+  if (!num)
+    goto err_out;
+  notify_fd = force_poll ? -1 : notify_init(installs, num);
+#ifndef _WIN32
+  // with a control socket, run headless without touching the terminal.
+  // Created last, so clients can rely on everything being watched.
+  if (control_path && !control_init(control_path))
+    goto err_out;
+#endif
+  signal(SIGINT, quit_handler);
+  signal(SIGTERM, quit_handler);
+#ifndef _WIN32
+  // control clients that went away must not kill us
+  signal(SIGPIPE, SIG_IGN);
+#endif
+  if (installs_fname || control_path)
+    printf("Watching %i installs%s\n", num, control_path ? "" : ", press 'q' to exit");
+  else
+    print_list(&installs[0]);
+  if (!control_path)
+    noblock_init();
+  seen = now_us();
+  while (!quit) {
     int key;
-    if (check_and_replace(list[list_pos])) {
-      move_list(list, &list_pos, 1);
-      print_list(list, list_pos);
+    for (i = 0; i < num; i++) {
+      struct install *in = &installs[i];
+      struct replace_event ev;
+      int res = 0;
+      ev.seen = seen;
+      if (in->changed)
+        res = check_and_replace(in, &ev);
+      in->changed = 0;
+      if (res)
+        record_replace(in, &ev);
+      if (res > 0) {
+        move_list(in, 1);
+        if (installs_fname || control_path)
+          printf("%s: next mission %s\n", in->dir ? in->dir : ".", in->campaign.missions[in->pos].name);
+        else
+          print_list(in);
+        fflush(stdout);
+      }
     }
 
     // check input and allow moving up/down in list
-    key = get_char_noblock();
+    key = wait_event(notify_fd, !control_path, installs, num);
+    seen = now_us();
     switch (key) {
     case 'w':
     case 's':
-      move_list(list, &list_pos, key == 's' ? 1 : -1);
-      print_list(list, list_pos);
+      // moving is only supported with a single install
+      if (installs_fname)
+        break;
+      move_list(&installs[0], key == 's' ? 1 : -1);
+      log_event("move", &installs[0], NULL);
+      print_list(&installs[0]);
     }
     if (key == 'q')
       break;
-
-    usleep(0.01 * 1000 * 1000);
-  } while (1);
-  noblock_uninit();
-  free(list);
+  }
+  if (!control_path)
+    noblock_uninit();
+  if (notify_fd >= 0)
+    close(notify_fd);
+#ifndef _WIN32
+  while (num_clients)
+    control_drop(0);
+  if (control_fd >= 0) {
+    close(control_fd);
+    unlink(control_path);
+  }
+#endif
+  print_latency(&latency);
+  if (event_log)
+    fclose(event_log);
+  for (i = 0; i < num; i++)
+    install_free(&installs[i]);
+  free(installs);
   return 0;
 
 err_out:
-  fprintf(stderr, "Press enter to exit\n");
-  getchar();
-  free(list);
+  if (!control_path) {
+    fprintf(stderr, "Press enter to exit\n");
+    getchar();
+  }
+  if (event_log)
+    fclose(event_log);
+  for (i = 0; i < num; i++)
+    install_free(&installs[i]);
+  free(installs);
   return 1;
 }
+#endif